@@ -0,0 +1,623 @@
+// AnnotationIndex.h : on-disk, memory mapped shape index.
+//
+// Layout of an index file, every section starts at a page boundary:
+//
+//   IndexHeader
+//   LabelRecord[label_count]
+//   ImageRecord[image_count]
+//   char strings[strings_size]      names of labels and images
+//   ShapeRecord[shape_count]        grouped by image, in image order
+//   cv::Point points[point_count]   grouped by shape, in shape order
+//   PostingRecord[posting_count]    grouped by label, images in order
+//
+// The postings are an inverted label -> images index. Every label lists the
+// images it occurs in together with its number of shapes in that image.
+//
+// Shapes and points of one image are contiguous, so rendering an image only
+// faults in the few pages holding that image. Pages are handed back to the
+// kernel with release() once an image is done, so the resident size stays
+// bounded no matter how many shapes the task has.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+#include "Shape.h"
+#include "SpanMask.h"
+
+static_assert(sizeof(cv::Point) == 2 * sizeof(int32_t),
+              "points are stored as two int32");
+
+struct IndexHeader
+{
+    static constexpr char expected_magic[8] = {'C', 'V', 'A', 'T',
+                                               'I', 'D', 'X', '1'};
+    static constexpr uint32_t current_version = 7;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t label_count;
+    uint64_t image_count;
+    uint64_t shape_count;
+    uint64_t point_count;
+    uint64_t labels_offset;
+    uint64_t images_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t shapes_offset;
+    uint64_t points_offset;
+    uint64_t posting_count;
+    uint64_t postings_offset;
+    // IndexOptions the shapes were stored with
+    double simplify_tolerance;
+    uint64_t label_map_hash;
+};
+
+// Parse options that change the stored shapes, an index built with other
+// options is out of date.
+struct IndexOptions
+{
+    double simplify_tolerance = 0.0;
+    // LabelMap::hash() of the --label-map, 0 without one
+    uint64_t label_map_hash = 0;
+};
+
+struct LabelRecord
+{
+    uint64_t name_offset;
+    uint32_t name_size;
+    uint32_t posting_count;
+    uint64_t first_posting;
+};
+
+struct PostingRecord
+{
+    uint32_t image;
+    uint32_t instances;
+};
+
+struct ImageRecord
+{
+    uint64_t name_offset;
+    uint32_t name_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t shape_count;
+    uint64_t first_shape;
+};
+
+struct ShapeRecord
+{
+    ShapeType type;
+    uint8_t has_group;
+    uint8_t monotone;
+    uint8_t reserved;
+    uint32_t label;
+    uint32_t group;
+    uint32_t point_count;
+    uint64_t first_point;
+    int32_t values[4];
+    float rotation;
+    int32_t z_order;
+};
+
+class MappedFile
+{
+    void *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+
+  public:
+    explicit MappedFile(const std::filesystem::path &file)
+    {
+        m_size = (size_t)std::filesystem::file_size(file);
+#ifdef _WIN32
+        m_file = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open " + file.string());
+        m_mapping =
+            CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping != nullptr)
+            m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_data == nullptr)
+            throw std::runtime_error("Cannot map " + file.string());
+#else
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open " + file.string());
+        m_data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m_data == MAP_FAILED)
+        {
+            m_data = nullptr;
+            throw std::runtime_error("Cannot map " + file.string());
+        }
+        // accesses jump between images, read-ahead would only waste memory
+        madvise(m_data, m_size, MADV_RANDOM);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (m_data != nullptr)
+            UnmapViewOfFile(m_data);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data != nullptr)
+            munmap(m_data, m_size);
+#endif
+    }
+
+    const char *data() const noexcept { return (const char *)m_data; }
+    size_t size() const noexcept { return m_size; }
+
+    // Hints that [begin, end) is about to be read.
+    void prefetch(const void *begin, const void *end) const noexcept
+    {
+#ifndef _WIN32
+        advise(begin, end, MADV_WILLNEED);
+#endif
+    }
+
+    // Drops the pages of [begin, end) from the resident set, they are read
+    // again from the page cache on the next access.
+    void release(const void *begin, const void *end) const noexcept
+    {
+#ifdef _WIN32
+        VirtualUnlock((LPVOID)begin, (SIZE_T)((const char *)end -
+                                              (const char *)begin));
+#else
+        advise(begin, end, MADV_DONTNEED);
+#endif
+    }
+
+  private:
+#ifndef _WIN32
+    void advise(const void *begin, const void *end, int advice) const noexcept
+    {
+        const auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        const auto first = (uintptr_t)begin & ~(page - 1);
+        const auto last = (uintptr_t)end;
+        if (last > first)
+            madvise((void *)first, last - first, advice);
+    }
+#endif
+};
+
+// Builds an index file. Labels and images are kept in memory, shapes and
+// points are streamed to temporary files and appended at the end.
+class AnnotationIndexWriter
+{
+    static constexpr uint32_t page_size = 4096;
+
+    std::filesystem::path m_file;
+    IndexOptions m_options;
+    std::filesystem::path m_shapes_file;
+    std::filesystem::path m_points_file;
+    std::ofstream m_shapes;
+    std::ofstream m_points;
+    std::vector<LabelRecord> m_labels;
+    std::unordered_map<std::string, uint32_t> m_label_ids;
+    std::vector<std::vector<PostingRecord>> m_postings;
+    std::vector<ImageRecord> m_images;
+    std::string m_strings;
+    uint64_t m_shape_count = 0;
+    uint64_t m_point_count = 0;
+
+    uint64_t add_string(std::string_view s)
+    {
+        const uint64_t offset = m_strings.size();
+        m_strings.append(s);
+        return offset;
+    }
+
+    static void pad_to_page(std::ofstream &out)
+    {
+        const auto pos = (uint64_t)out.tellp();
+        const uint64_t padded = (pos + page_size - 1) / page_size * page_size;
+        for (uint64_t i = pos; i < padded; ++i)
+            out.put('\0');
+    }
+
+    static void append_file(std::ofstream &out,
+                            const std::filesystem::path &file)
+    {
+        std::ifstream in(file, std::ios::binary);
+        out << in.rdbuf();
+    }
+
+  public:
+    explicit AnnotationIndexWriter(std::filesystem::path file,
+                                   const IndexOptions &options = {})
+        : m_file{std::move(file)}, m_options{options}
+    {
+        m_shapes_file = m_file;
+        m_shapes_file += ".shapes.tmp";
+        m_points_file = m_file;
+        m_points_file += ".points.tmp";
+        m_shapes.open(m_shapes_file, std::ios::binary | std::ios::trunc);
+        m_points.open(m_points_file, std::ios::binary | std::ios::trunc);
+        if (!m_shapes || !m_points)
+            throw std::runtime_error("Cannot write " + m_file.string());
+    }
+
+    uint32_t add_label(std::string_view name)
+    {
+        auto [it, inserted] = m_label_ids.try_emplace(std::string(name),
+                                                      (uint32_t)m_labels.size());
+        if (inserted)
+        {
+            m_labels.push_back({add_string(name), (uint32_t)name.size(), 0, 0});
+            m_postings.emplace_back();
+        }
+        return it->second;
+    }
+
+    void begin_image(std::string_view name, uint32_t width, uint32_t height)
+    {
+        m_images.push_back({add_string(name), (uint32_t)name.size(), width,
+                            height, 0, m_shape_count});
+    }
+
+    void add_shape(const ShapeData &shape, std::string_view label,
+                   std::optional<unsigned> group)
+    {
+        ShapeRecord record{};
+        record.type = shape.type;
+        record.has_group = group.has_value();
+        // classified once here, rendering from the index never has to
+        record.monotone =
+            shape.type == ShapeType::polygon &&
+            (shape.monotone ? *shape.monotone
+                            : SpanMask::is_monotone(shape.points));
+        record.label = add_label(label);
+        auto &postings = m_postings[record.label];
+        const auto image = (uint32_t)(m_images.size() - 1);
+        if (postings.empty() || postings.back().image != image)
+            postings.push_back({image, 0});
+        ++postings.back().instances;
+        record.group = group.value_or(0);
+        record.point_count = (uint32_t)shape.points.size();
+        record.first_point = m_point_count;
+        std::copy(std::begin(shape.values), std::end(shape.values),
+                  record.values);
+        record.rotation = shape.rotation;
+        record.z_order = shape.z_order;
+
+        m_shapes.write((const char *)&record, sizeof(record));
+        m_points.write((const char *)shape.points.data(),
+                       (std::streamsize)shape.points.size_bytes());
+        m_point_count += shape.points.size();
+        ++m_shape_count;
+        ++m_images.back().shape_count;
+    }
+
+    void finish()
+    {
+        m_shapes.close();
+        m_points.close();
+
+        std::ofstream out(m_file, std::ios::binary | std::ios::trunc);
+        IndexHeader header{};
+        std::copy(std::begin(IndexHeader::expected_magic),
+                  std::end(IndexHeader::expected_magic), header.magic);
+        header.version = IndexHeader::current_version;
+        header.page_size = page_size;
+        header.label_count = m_labels.size();
+        header.image_count = m_images.size();
+        header.shape_count = m_shape_count;
+        header.point_count = m_point_count;
+        header.simplify_tolerance = m_options.simplify_tolerance;
+        header.label_map_hash = m_options.label_map_hash;
+        out.write((const char *)&header, sizeof(header));
+
+        pad_to_page(out);
+        header.labels_offset = (uint64_t)out.tellp();
+        out.write((const char *)m_labels.data(),
+                  (std::streamsize)(m_labels.size() * sizeof(LabelRecord)));
+        pad_to_page(out);
+        header.images_offset = (uint64_t)out.tellp();
+        out.write((const char *)m_images.data(),
+                  (std::streamsize)(m_images.size() * sizeof(ImageRecord)));
+        pad_to_page(out);
+        header.strings_offset = (uint64_t)out.tellp();
+        header.strings_size = m_strings.size();
+        out.write(m_strings.data(), (std::streamsize)m_strings.size());
+        pad_to_page(out);
+        header.shapes_offset = (uint64_t)out.tellp();
+        if (m_shape_count > 0)
+            append_file(out, m_shapes_file);
+        pad_to_page(out);
+        header.points_offset = (uint64_t)out.tellp();
+        if (m_point_count > 0)
+            append_file(out, m_points_file);
+        pad_to_page(out);
+        header.postings_offset = (uint64_t)out.tellp();
+        for (auto &&postings : m_postings)
+        {
+            out.write((const char *)postings.data(),
+                      (std::streamsize)(postings.size() *
+                                        sizeof(PostingRecord)));
+            header.posting_count += postings.size();
+        }
+
+        // the label records precede the postings, fill in their ranges
+        uint64_t first_posting = 0;
+        for (size_t l = 0; l < m_labels.size(); ++l)
+        {
+            m_labels[l].first_posting = first_posting;
+            m_labels[l].posting_count = (uint32_t)m_postings[l].size();
+            first_posting += m_postings[l].size();
+        }
+        out.seekp((std::streamoff)header.labels_offset);
+        out.write((const char *)m_labels.data(),
+                  (std::streamsize)(m_labels.size() * sizeof(LabelRecord)));
+
+        out.seekp(0);
+        out.write((const char *)&header, sizeof(header));
+        if (!out)
+            throw std::runtime_error("Cannot write " + m_file.string());
+
+        std::filesystem::remove(m_shapes_file);
+        std::filesystem::remove(m_points_file);
+    }
+};
+
+class AnnotationIndex
+{
+    MappedFile m_file;
+    const IndexHeader *m_header;
+
+    template <typename T> const T *section(uint64_t offset) const noexcept
+    {
+        return (const T *)(m_file.data() + offset);
+    }
+
+    std::string_view string(uint64_t offset, uint32_t size) const noexcept
+    {
+        return {section<char>(m_header->strings_offset) + offset, size};
+    }
+
+  public:
+    explicit AnnotationIndex(const std::filesystem::path &file)
+        : m_file{file}, m_header{(const IndexHeader *)m_file.data()}
+    {
+        if (m_file.size() < sizeof(IndexHeader) ||
+            !std::equal(std::begin(IndexHeader::expected_magic),
+                        std::end(IndexHeader::expected_magic),
+                        m_header->magic) ||
+            m_header->version != IndexHeader::current_version)
+        {
+            throw std::runtime_error(file.string() +
+                                     " is not a CVATTools index");
+        }
+    }
+
+    class Image
+    {
+        const AnnotationIndex *m_index;
+        const ImageRecord *m_record;
+
+        std::span<const ShapeRecord> shape_records() const noexcept
+        {
+            return {m_index->section<ShapeRecord>(
+                        m_index->m_header->shapes_offset) +
+                        m_record->first_shape,
+                    m_record->shape_count};
+        }
+
+        ShapeData shape(const ShapeRecord &record) const noexcept
+        {
+            ShapeData shape;
+            shape.type = record.type;
+            shape.points = {m_index->section<cv::Point>(
+                                m_index->m_header->points_offset) +
+                                record.first_point,
+                            record.point_count};
+            std::copy(std::begin(record.values), std::end(record.values),
+                      shape.values);
+            shape.rotation = record.rotation;
+            shape.z_order = record.z_order;
+            shape.monotone = record.monotone != 0;
+            return shape;
+        }
+
+        // Byte ranges of the shape and point records of this image.
+        std::pair<const void *, const void *> shape_range() const noexcept
+        {
+            auto shapes = shape_records();
+            return {shapes.data(), shapes.data() + shapes.size()};
+        }
+        std::pair<const void *, const void *> point_range() const noexcept
+        {
+            auto shapes = shape_records();
+            if (shapes.empty())
+                return {nullptr, nullptr};
+            const auto *points = m_index->section<cv::Point>(
+                m_index->m_header->points_offset);
+            return {points + shapes.front().first_point,
+                    points + shapes.back().first_point +
+                        shapes.back().point_count};
+        }
+
+      public:
+        Image(const AnnotationIndex *index, const ImageRecord *record)
+            : m_index{index}, m_record{record}
+        {
+        }
+
+        size_t width() const noexcept { return m_record->width; }
+        size_t height() const noexcept { return m_record->height; }
+        std::string_view filename() const noexcept
+        {
+            return m_index->string(m_record->name_offset, m_record->name_size);
+        }
+
+        size_t shape_count() const noexcept { return m_record->shape_count; }
+
+        // Number of vertices over all shapes, a measure of the work to
+        // render the image.
+        size_t vertex_count() const noexcept
+        {
+            size_t result = 0;
+            for (auto &&record : shape_records())
+                result += std::max<size_t>(record.point_count, 1);
+            return result;
+        }
+
+        // Calls f(label id, ShapeData) for every shape of the image.
+        template <typename F> void for_each_shape(F &&f) const
+        {
+            for (auto &&record : shape_records())
+                f(record.label, shape(record));
+        }
+
+        cv::Mat mask_combined(uint32_t label) const
+        {
+            cv::Mat result((int)height(), (int)width(), CV_8UC1,
+                           (unsigned char)0);
+            for (auto &&record : shape_records())
+            {
+                if (record.label == label)
+                    draw_shape(result, shape(record));
+            }
+            return result;
+        }
+
+        SpanMask spans_combined(uint32_t label) const
+        {
+            SpanMask result((int)width(), (int)height());
+            for (auto &&record : shape_records())
+            {
+                if (record.label == label)
+                    draw_shape(result, shape(record));
+            }
+            result.finalize();
+            return result;
+        }
+
+        void prefetch() const noexcept
+        {
+            auto [sb, se] = shape_range();
+            m_index->m_file.prefetch(sb, se);
+            auto [pb, pe] = point_range();
+            if (pb != nullptr)
+                m_index->m_file.prefetch(pb, pe);
+        }
+
+        void release() const noexcept
+        {
+            auto [sb, se] = shape_range();
+            m_index->m_file.release(sb, se);
+            auto [pb, pe] = point_range();
+            if (pb != nullptr)
+                m_index->m_file.release(pb, pe);
+        }
+    };
+
+    size_t image_count() const noexcept { return m_header->image_count; }
+    size_t shape_count() const noexcept { return m_header->shape_count; }
+
+    Image image(size_t i) const noexcept
+    {
+        return {this, section<ImageRecord>(m_header->images_offset) + i};
+    }
+
+    std::vector<std::string_view> labels() const
+    {
+        std::vector<std::string_view> result;
+        const auto *records = section<LabelRecord>(m_header->labels_offset);
+        for (size_t i = 0; i < m_header->label_count; ++i)
+        {
+            result.push_back(
+                string(records[i].name_offset, records[i].name_size));
+        }
+        return result;
+    }
+
+    // Images with at least `min_instances` shapes of the label, answered
+    // from the postings without touching any shape.
+    std::vector<std::string_view>
+    images_with_label(std::string_view label, size_t min_instances = 1) const
+    {
+        std::vector<std::string_view> result;
+        const auto *records = section<LabelRecord>(m_header->labels_offset);
+        const auto *images = section<ImageRecord>(m_header->images_offset);
+        for (size_t l = 0; l < m_header->label_count; ++l)
+        {
+            if (string(records[l].name_offset, records[l].name_size) != label)
+                continue;
+
+            const auto *postings =
+                section<PostingRecord>(m_header->postings_offset) +
+                records[l].first_posting;
+            for (size_t p = 0; p < records[l].posting_count; ++p)
+            {
+                if (postings[p].instances < min_instances)
+                    continue;
+                const auto &image = images[postings[p].image];
+                result.push_back(string(image.name_offset, image.name_size));
+            }
+        }
+        return result;
+    }
+
+    static bool is_index_file(const std::filesystem::path &file)
+    {
+        char magic[sizeof(IndexHeader::expected_magic)] = {};
+        std::ifstream(file, std::ios::binary).read(magic, sizeof(magic));
+        return std::equal(std::begin(magic), std::end(magic),
+                          std::begin(IndexHeader::expected_magic));
+    }
+
+    // True if `file` is an index this version can read, built with
+    // `options`.
+    static bool is_current(const std::filesystem::path &file,
+                           const IndexOptions &options)
+    {
+        IndexHeader header{};
+        std::ifstream(file, std::ios::binary)
+            .read((char *)&header, sizeof(header));
+        return is_index_file(file) &&
+               header.version == IndexHeader::current_version &&
+               header.simplify_tolerance == options.simplify_tolerance &&
+               header.label_map_hash == options.label_map_hash;
+    }
+};
@@ -0,0 +1,149 @@
+// AnnotationStream.h : reads a CVAT annotations.xml one element at a time.
+//
+// The document is never loaded as a whole. The <meta> block and every
+// <image> element are cut out of the character stream and parsed on their
+// own, so memory stays bounded by the largest single image.
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <pugixml.hpp>
+
+class AnnotationStream
+{
+    static constexpr size_t chunk_size = 1 << 20;
+
+    std::istream &m_in;
+    std::string m_buffer;
+    size_t m_pos = 0;
+
+    bool read_more()
+    {
+        if (!m_in)
+            return false;
+
+        // drop what has already been handed out before growing the buffer
+        if (m_pos > m_buffer.size() / 2)
+        {
+            m_buffer.erase(0, m_pos);
+            m_pos = 0;
+        }
+
+        const size_t old_size = m_buffer.size();
+        m_buffer.resize(old_size + chunk_size);
+        m_in.read(m_buffer.data() + old_size, chunk_size);
+        m_buffer.resize(old_size + (size_t)m_in.gcount());
+        return m_in.gcount() > 0;
+    }
+
+    // Position of the next "<tag" start tag at or after `from`, or npos.
+    size_t find_start_tag(std::string_view tag, size_t from) const
+    {
+        for (;;)
+        {
+            from = m_buffer.find(tag, from);
+            if (from == std::string::npos || from + tag.size() >= m_buffer.size())
+                return std::string::npos;
+            const char next = m_buffer[from + tag.size()];
+            if (next == '>' || next == '/' || isspace((unsigned char)next))
+                return from;
+            ++from;
+        }
+    }
+
+    // One past the end of the element starting at `begin`, or npos if the
+    // buffer does not contain all of it yet. Quoted attribute values may
+    // contain '>', so they are skipped while looking for the end of the tag.
+    size_t element_end(std::string_view tag, size_t begin) const
+    {
+        char quote = 0;
+        size_t i = begin + 1;
+        for (; i < m_buffer.size(); ++i)
+        {
+            const char c = m_buffer[i];
+            if (quote != 0)
+            {
+                if (c == quote)
+                    quote = 0;
+            }
+            else if (c == '"' || c == '\'')
+            {
+                quote = c;
+            }
+            else if (c == '>')
+            {
+                break;
+            }
+        }
+        if (i >= m_buffer.size())
+            return std::string::npos;
+        if (m_buffer[i - 1] == '/')
+            return i + 1;
+
+        const std::string close = "</" + std::string(tag) + ">";
+        const size_t end = m_buffer.find(close, i);
+        return end == std::string::npos ? end : end + close.size();
+    }
+
+    // Parses the next complete <tag> element into `doc`. Stops at `stop_tag`
+    // if that one comes first, which leaves it in the stream.
+    bool next(std::string_view tag, pugi::xml_document &doc,
+              std::string_view stop_tag = {})
+    {
+        const std::string open = "<" + std::string(tag);
+        const std::string stop =
+            stop_tag.empty() ? std::string() : "<" + std::string(stop_tag);
+        for (;;)
+        {
+            const size_t begin = find_start_tag(open, m_pos);
+            if (!stop.empty())
+            {
+                const size_t stop_pos = find_start_tag(stop, m_pos);
+                if (stop_pos != std::string::npos && stop_pos < begin)
+                    return false;
+            }
+            if (begin != std::string::npos)
+            {
+                const size_t end = element_end(tag, begin);
+                if (end != std::string::npos)
+                {
+                    const auto result = doc.load_buffer(
+                        m_buffer.data() + begin, end - begin,
+                        pugi::parse_default | pugi::parse_fragment);
+                    if (!result)
+                    {
+                        throw std::runtime_error(
+                            std::string("Cannot parse <") + std::string(tag) +
+                            ">: " + result.description());
+                    }
+                    m_pos = end;
+                    return true;
+                }
+            }
+            else
+            {
+                // nothing useful in here, keep only a possible partial tag
+                const size_t keep = std::max(open.size(), stop.size());
+                if (m_buffer.size() > m_pos + keep)
+                    m_pos = m_buffer.size() - keep;
+            }
+            if (!read_more())
+                return false;
+        }
+    }
+
+  public:
+    explicit AnnotationStream(std::istream &in) : m_in{in} {}
+
+    // Reads the <meta> block, it precedes all images in CVAT exports.
+    bool next_meta(pugi::xml_document &doc) { return next("meta", doc, "image"); }
+
+    // Reads the next <image> element, false at the end of the document.
+    bool next_image(pugi::xml_document &doc) { return next("image", doc); }
+};
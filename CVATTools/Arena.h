@@ -0,0 +1,209 @@
+// Arena.h : monotonic allocation for the parsed document and for the
+// per-image scratch memory of the workers.
+//
+// DocumentArena backs all pugixml allocations made while a document is
+// loaded. Nothing is freed until the arena goes away together with the
+// document, so loading a large annotations.xml is a handful of big
+// allocations instead of many page sized ones.
+//
+// ScratchArena is a per-thread std::pmr resource for the point buffers that
+// are decoded for every shape. It is reset after every image, so a worker
+// keeps reusing the same memory instead of going through the heap for
+// every shape of every label.
+//
+// With huge_pages enabled, the large chunks of both are on 2 MB pages.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <vector>
+
+#include <pugixml.hpp>
+
+#include "HugePages.h"
+
+class DocumentArena
+{
+    static constexpr size_t first_chunk_size = size_t(1) << 20;
+    static constexpr size_t max_chunk_size = size_t(64) << 20;
+    static constexpr size_t alignment = alignof(std::max_align_t);
+
+    struct Chunk
+    {
+        std::byte *data;
+        size_t size;
+        bool huge;
+    };
+    std::vector<Chunk> m_chunks;
+    std::byte *m_next = nullptr;
+    std::byte *m_end = nullptr;
+    size_t m_chunk_size = first_chunk_size;
+
+    // pugixml has a single global deallocation hook, it has to tell arena
+    // memory from heap memory of documents loaded without an arena. Every
+    // block handed to pugixml follows a header recording where it came
+    // from, so that takes neither a lock nor a lookup.
+    enum class Origin : uintptr_t
+    {
+        heap,
+        arena,
+    };
+    static constexpr size_t header_size = alignment;
+
+    static DocumentArena *&active() noexcept
+    {
+        thread_local DocumentArena *arena = nullptr;
+        return arena;
+    }
+
+    static void *tag(void *block, Origin origin) noexcept
+    {
+        if (block == nullptr)
+            return nullptr;
+        *(Origin *)block = origin;
+        return (std::byte *)block + header_size;
+    }
+
+    static void *allocate_hook(size_t size)
+    {
+        if (DocumentArena *arena = active())
+            return tag(arena->allocate(size + header_size), Origin::arena);
+        return tag(malloc(size + header_size), Origin::heap);
+    }
+
+    static void deallocate_hook(void *p)
+    {
+        if (p == nullptr)
+            return;
+        // arena memory is freed with the arena
+        void *block = (std::byte *)p - header_size;
+        if (*(const Origin *)block == Origin::heap)
+            free(block);
+    }
+
+    // Installed before main, before any document exists, so every block
+    // pugixml frees has a header.
+    static inline const bool hooks_installed = []
+    {
+        pugi::set_memory_management_functions(&allocate_hook,
+                                              &deallocate_hook);
+        return true;
+    }();
+
+    void *allocate(size_t size)
+    {
+        size = (size + alignment - 1) & ~(alignment - 1);
+        if ((size_t)(m_end - m_next) < size)
+        {
+            const size_t chunk = std::max(size, m_chunk_size);
+            m_chunk_size = std::min(m_chunk_size * 2, max_chunk_size);
+            // operator new[] is aligned for std::max_align_t, huge pages
+            // to 2 MB
+            const bool huge = huge_pages::eligible(chunk);
+            auto data = huge ? (std::byte *)huge_pages::allocate(chunk)
+                             : new (std::nothrow) std::byte[chunk];
+            if (data == nullptr)
+                return nullptr;
+            m_chunks.push_back({data, chunk, huge});
+            m_next = data;
+            m_end = m_next + chunk;
+        }
+        void *result = m_next;
+        m_next += size;
+        return result;
+    }
+
+  public:
+    DocumentArena() = default;
+    DocumentArena(const DocumentArena &) = delete;
+    DocumentArena &operator=(const DocumentArena &) = delete;
+
+    ~DocumentArena()
+    {
+        for (auto &&chunk : m_chunks)
+        {
+            if (chunk.huge)
+                huge_pages::deallocate(chunk.data, chunk.size);
+            else
+                delete[] chunk.data;
+        }
+    }
+
+    // Routes pugixml allocations made on this thread into `arena` while the
+    // scope is alive, `nullptr` keeps using the heap.
+    class Scope
+    {
+        DocumentArena *m_previous;
+
+      public:
+        explicit Scope(DocumentArena *arena) : m_previous{active()}
+        {
+            active() = arena;
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+        ~Scope() { active() = m_previous; }
+    };
+};
+
+class ScratchArena
+{
+    static constexpr size_t initial_size = 256 << 10;
+
+    std::vector<std::byte> m_initial;
+    std::pmr::monotonic_buffer_resource m_resource;
+    // open scopes, the arena is reset when the outermost one ends
+    unsigned m_depth = 0;
+
+    ScratchArena()
+        : m_initial(initial_size),
+          m_resource{m_initial.data(), m_initial.size(),
+                     huge_pages::Resource::instance()}
+    {
+    }
+
+    static ScratchArena &local()
+    {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+  public:
+    // Resource for scratch memory on this thread. Inside a Scope it is the
+    // thread's arena, outside of one the default heap resource.
+    static std::pmr::memory_resource *resource()
+    {
+        ScratchArena &arena = local();
+        return arena.m_depth > 0
+                   ? (std::pmr::memory_resource *)&arena.m_resource
+                   : std::pmr::get_default_resource();
+    }
+
+    // Per image scope of a worker. Everything allocated from resource()
+    // inside the outermost scope must be gone when it ends, the arena is
+    // reset then. Nested scopes share the memory of the outer one.
+    class Scope
+    {
+        bool m_enabled;
+
+      public:
+        explicit Scope(bool enabled = true) : m_enabled{enabled}
+        {
+            if (m_enabled)
+                ++local().m_depth;
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+        ~Scope()
+        {
+            if (!m_enabled)
+                return;
+            if (--local().m_depth == 0)
+                local().m_resource.release();
+        }
+    };
+};
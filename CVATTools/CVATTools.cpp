@@ -1,487 +1,1619 @@
-﻿#include <charconv>
-#include <future>
-#include <optional>
+﻿#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include <pugixml.hpp>
 
+#include "AnnotationIndex.h"
+#include "AnnotationStream.h"
 #include "CLI11.hpp"
+#include "CVATTools.h"
+#include "Checksums.h"
+#include "HttpSink.h"
+#include "HugePages.h"
+#include "ImageHeader.h"
+#include "MaskSink.h"
+#include "Metrics.h"
+#include "PerfCounters.h"
+#include "PngWriter.h"
+#include "Shape.h"
+#include "ShmRing.h"
+#include "SpanMask.h"
+
+long long milliseconds_since(
+    std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::high_resolution_clock::now() - start)
+        .count();
+}
 
-class Geometry
+// Page faults of the process and the kernel time spent on its behalf,
+// which is mostly fault handling while masks are rendered.
+struct PageFaults
 {
-    pugi::xml_node m_geometry;
-    static std::vector<cv::Point>
-    parse_points(const pugi::xml_node &node_with_point_attr)
+    long minor = 0;
+    long major = 0;
+    double system_ms = 0.0;
+
+    static PageFaults now() noexcept
     {
-        const auto ptr_start =
-            node_with_point_attr.attribute("points").as_string();
-        const auto ptr_end = ptr_start + strlen(ptr_start);
-        auto cur = ptr_start;
-        std::vector<cv::Point> pts;
-        while (cur < ptr_end)
+        PageFaults faults;
+#ifndef _WIN32
+        rusage usage{};
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
         {
-            auto x_coord_end = strchr(cur, ',');
-            if (x_coord_end == nullptr)
-                x_coord_end = ptr_end;
-            auto y_coord_end = strchr(cur, ';');
-            y_coord_end = (y_coord_end != nullptr) ? y_coord_end : ptr_end;
-
-            int x, y;
-            std::from_chars(cur, x_coord_end, x);
-            std::from_chars(x_coord_end + 1,
-                            (y_coord_end == nullptr) ? ptr_end : y_coord_end,
-                            y);
-            cur = y_coord_end + 1;
-            pts.emplace_back(x, y);
+            faults.minor = usage.ru_minflt;
+            faults.major = usage.ru_majflt;
+            faults.system_ms = usage.ru_stime.tv_sec * 1000.0 +
+                               usage.ru_stime.tv_usec / 1000.0;
         }
-        return pts;
+#endif
+        return faults;
+    }
+};
+
+void print_page_faults(std::string_view phase, const PageFaults &start)
+{
+    const auto end = PageFaults::now();
+    std::cout << phase << " page faults: " << end.minor - start.minor
+              << " minor, " << end.major - start.major
+              << " major, system time " << end.system_ms - start.system_ms
+              << "ms\n";
+}
+
+// Render, encode and write time of one image in microseconds, summed over
+// its masks, which may be done by several workers.
+struct ImageTimes
+{
+    std::atomic<int64_t> render{0};
+    std::atomic<int64_t> encode{0};
+    std::atomic<int64_t> write{0};
+
+    int64_t total() const noexcept { return render + encode + write; }
+};
+
+// Attributes the time since the previous call to a phase of an image and
+// to the latency histogram of the phase, and the hardware counters to the
+// stage with --perf-counters. Does nothing if none of them is wanted.
+class PhaseTimer
+{
+    ImageTimes *m_times;
+    bool m_active;
+    std::chrono::high_resolution_clock::time_point m_last;
+    PerfValues m_perf_last;
+
+    void add(std::atomic<int64_t> ImageTimes::*phase, Histogram &histogram,
+             PerfStage stage)
+    {
+        if (!m_active)
+            return;
+        m_perf_last = PerfCounters::add(stage, m_perf_last);
+        const auto now = std::chrono::high_resolution_clock::now();
+        const auto us =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - m_last)
+                .count();
+        m_last = now;
+        if (m_times != nullptr)
+            m_times->*phase += us;
+        histogram.observe_us(us);
     }
 
   public:
-    Geometry(pugi::xml_node geometry_node)
-        : m_geometry{std::move(geometry_node)}
+    explicit PhaseTimer(ImageTimes *times)
+        : m_times{times}, m_active{times != nullptr || metrics().enabled ||
+                                   PerfCounters::enabled()}
     {
+        if (!m_active)
+            return;
+        m_last = std::chrono::high_resolution_clock::now();
+        m_perf_last = PerfCounters::now();
     }
 
-    std::optional<unsigned> group() const noexcept
+    void rendered()
+    {
+        add(&ImageTimes::render, metrics().render_seconds, PerfStage::render);
+    }
+    void encoded()
+    {
+        add(&ImageTimes::encode, metrics().encode_seconds, PerfStage::encode);
+    }
+    void written()
     {
-        auto g = m_geometry.attribute("group_id");
-        if (g.empty())
-            return std::nullopt;
-        return g.as_uint();
+        add(&ImageTimes::write, metrics().write_seconds, PerfStage::write);
     }
+};
+
+// Collects the `k` images that took longest to render, encode and write.
+class SlowestImages
+{
+    struct Entry
+    {
+        int64_t render;
+        int64_t encode;
+        int64_t write;
+        std::string filename;
+        size_t width;
+        size_t height;
+        size_t shapes;
+        size_t vertices;
+
+        int64_t total() const noexcept { return render + encode + write; }
+    };
+
+    size_t m_k;
+    std::mutex m_mutex;
+    // min-heap on the total time, the fastest of the slowest on top
+    std::vector<Entry> m_entries;
 
-    std::string_view label() const noexcept
+    static bool slower(const Entry &a, const Entry &b) noexcept
     {
-        return m_geometry.attribute("label").as_string();
+        return a.total() > b.total();
     }
 
-    void draw_mask(cv::Mat &in_out) const noexcept
+  public:
+    explicit SlowestImages(size_t k) : m_k{k} {}
+
+    bool enabled() const noexcept { return m_k > 0; }
+
+    // Whether an image taking `total` microseconds would be listed.
+    bool qualifies(int64_t total)
     {
-        if (strcmp(m_geometry.name(), "polygon") == 0)
-        {
-            const std::vector<cv::Point> pts = parse_points(m_geometry);
-            cv::fillPoly(in_out, pts, (unsigned char)255);
-        }
-        else if (strcmp(m_geometry.name(), "box") == 0)
-        {
-            const auto xtl = m_geometry.attribute("xtl").as_int();
-            const auto ytl = m_geometry.attribute("ytl").as_int();
-            const auto xbr = m_geometry.attribute("xbr").as_int();
-            const auto ybr = m_geometry.attribute("ybr").as_int();
+        std::lock_guard lock{m_mutex};
+        return m_entries.size() < m_k || total > m_entries.front().total();
+    }
 
-            cv::rectangle(in_out, cv::Rect{xtl, ytl, xbr - xtl, ybr - ytl}, 255,
-                          cv::FILLED);
-        }
-        else if (strcmp(m_geometry.name(), "points") == 0)
+    template <typename ImageT>
+    void add(const ImageT &image, const ImageTimes &times)
+    {
+        if (!enabled() || !qualifies(times.total()))
+            return;
+        Entry entry{times.render,         times.encode,
+                    times.write,          std::string(image.filename()),
+                    image.width(),        image.height(),
+                    image.shape_count(), image.vertex_count()};
+        std::lock_guard lock{m_mutex};
+        m_entries.push_back(std::move(entry));
+        std::push_heap(m_entries.begin(), m_entries.end(), slower);
+        if (m_entries.size() > m_k)
         {
-            const std::vector<cv::Point> pts = parse_points(m_geometry);
-
-            for (auto &&p : pts)
-            {
-                cv::circle(in_out, p, 0, 255, cv::FILLED);
-            }
+            std::pop_heap(m_entries.begin(), m_entries.end(), slower);
+            m_entries.pop_back();
         }
-        else if (strcmp(m_geometry.name(), "polyline") == 0)
+    }
+
+    void print(std::ostream &out)
+    {
+        if (!enabled())
+            return;
+        std::lock_guard lock{m_mutex};
+        auto entries = m_entries;
+        std::sort(entries.begin(), entries.end(), slower);
+        out << "slowest images (render / encode / write):\n";
+        for (auto &&e : entries)
         {
-            const std::vector<cv::Point> pts = parse_points(m_geometry);
-            cv::polylines(in_out, pts, false, 255);
+            out << "  " << e.total() / 1000 << "ms (" << e.render / 1000
+                << " / " << e.encode / 1000 << " / " << e.write / 1000
+                << "ms) " << e.filename << ' ' << e.width << 'x' << e.height
+                << ", " << e.shapes << " shapes, " << e.vertices
+                << " vertices\n";
         }
-        else if (strcmp(m_geometry.name(), "ellipse") == 0)
+    }
+};
+
+// One bit per pixel of `spans`, laid out like render_packed().
+std::vector<uint64_t> pack_mask(const SpanMask &spans)
+{
+    const size_t words_per_row = ((size_t)spans.width() + 63) / 64;
+    std::vector<uint64_t> result(words_per_row * (size_t)spans.height(), 0);
+    paint_bits(spans, Raster<uint64_t>{result.data(), words_per_row});
+    return result;
+}
+
+// The same for the 8 bit `mask`, pixels that are not 0 are set.
+std::vector<uint64_t> pack_mask(const cv::Mat &mask)
+{
+    const size_t words_per_row = ((size_t)mask.cols + 63) / 64;
+    std::vector<uint64_t> result(words_per_row * (size_t)mask.rows, 0);
+    for (int y = 0; y < mask.rows; ++y)
+    {
+        const uchar *row = mask.ptr(y);
+        uint64_t *out = result.data() + (size_t)y * words_per_row;
+        for (int x = 0; x < mask.cols; ++x)
         {
-            const auto x = m_geometry.attribute("cx").as_int();
-            const auto y = m_geometry.attribute("cy").as_int();
-            const auto rx = m_geometry.attribute("rx").as_int();
-            const auto ry = m_geometry.attribute("ry").as_int();
-            const auto rotation_grad =
-                m_geometry.attribute("rotation").as_float(0.f);
-            cv::ellipse(in_out, cv::Point(x, y), cv::Size(rx, ry),
-                        rotation_grad, 0, 360, 255, cv::FILLED);
+            if (row[x] != 0)
+                out[x / 64] |= uint64_t(1) << (x % 64);
         }
     }
-};
+    return result;
+}
 
-class Image
+// PNG of the mask of `label`. Works for both Image and
+// AnnotationIndex::Image, `label` is whatever the image type identifies
+// labels by. If `packed` is given, the rendered mask is also stored there
+// bit-packed, for the derived labels.
+template <typename ImageT, typename Label>
+std::vector<uchar> encode_mask(const ImageT &image, const Label &label,
+                               const WriteOptions &write_options,
+                               PhaseTimer &timer,
+                               std::vector<uint64_t> *packed = nullptr)
 {
-    pugi::xml_node m_image_node;
+    std::vector<uchar> result;
+    if (write_options.mode == OutputMode::packed)
+    {
+        const auto words = render_packed(image, label);
+        timer.rendered();
+        result.assign((const uchar *)words.data(),
+                      (const uchar *)(words.data() + words.size()));
+        if (packed != nullptr)
+            *packed = words;
+    }
+    else if (write_options.span_render)
+    {
+        const auto spans = image.spans_combined(label);
+        timer.rendered();
+        result = encode_png(spans);
+        if (packed != nullptr)
+            *packed = pack_mask(spans);
+    }
+    else
+    {
+        const auto mask = image.mask_combined(label);
+        timer.rendered();
+        cv::imencode(".png", mask, result);
+        if (packed != nullptr)
+            *packed = pack_mask(mask);
+    }
+    timer.encoded();
+    return result;
+}
 
-  public:
-    Image(pugi::xml_node n) : m_image_node{std::move(n)} {}
-    size_t width() const noexcept
+// Output of the modes writing one file per image, class ids or bitfields.
+// The bitfield is stored raw, height rows of width little endian uint32.
+template <typename ImageT, typename LabelId>
+std::vector<uchar> encode_image(const ImageT &image, const LabelId &label_id,
+                                size_t label_count, OutputMode mode,
+                                PhaseTimer &timer)
+{
+    std::vector<uchar> result;
+    switch (mode)
+    {
+    case OutputMode::class8:
+    {
+        const auto classes =
+            render_classes<uint8_t>(image, label_id, label_count);
+        timer.rendered();
+        cv::imencode(".png", classes, result);
+        break;
+    }
+    case OutputMode::class16:
+    {
+        const auto classes =
+            render_classes<uint16_t>(image, label_id, label_count);
+        timer.rendered();
+        cv::imencode(".png", classes, result);
+        break;
+    }
+    case OutputMode::bitfield:
+    {
+        const auto bits = render_bitfield(image, label_id, label_count);
+        timer.rendered();
+        result.assign(bits.data, bits.data + bits.total() * sizeof(uint32_t));
+        break;
+    }
+    case OutputMode::binary:
+    case OutputMode::packed:
+        break;
+    }
+    timer.encoded();
+    return result;
+}
+
+bool per_image_mode(OutputMode mode) noexcept
+{
+    return mode == OutputMode::class8 || mode == OutputMode::class16 ||
+           mode == OutputMode::bitfield;
+}
+
+// Sink key of a mask, "<label>/<image name>.png", or .bin for the raw
+// modes. Per-image modes use "classes" or "bitfield" as the label.
+std::string mask_key(std::string_view label, std::string_view filename,
+                     OutputMode mode = OutputMode::binary)
+{
+    const bool raw = mode == OutputMode::packed || mode == OutputMode::bitfield;
+    return (std::filesystem::path(label) /
+            std::filesystem::path(filename).replace_extension(raw ? ".bin"
+                                                                  : ".png"))
+        .generic_string();
+}
+
+// Directory of the per-image modes.
+std::string_view per_image_directory(OutputMode mode) noexcept
+{
+    return mode == OutputMode::bitfield ? "bitfield" : "classes";
+}
+
+// Throws if `mode` cannot tell `label_count` labels apart.
+void check_label_count(size_t label_count, OutputMode mode)
+{
+    const size_t max_labels = mode == OutputMode::class8    ? 255
+                              : mode == OutputMode::class16 ? 65535
+                              : mode == OutputMode::bitfield ? 32
+                                                             : SIZE_MAX;
+    if (label_count > max_labels)
+    {
+        throw std::runtime_error("Too many labels for the output mode, it "
+                                 "supports " +
+                                 std::to_string(max_labels));
+    }
+}
+
+// Throws if the --derive expressions cannot be written in `mode`,
+// reference a label the task does not have, or have a name that is not a
+// single directory of its own: a label, another derived label or a path.
+void check_derived_labels(const std::vector<std::string_view> &labels,
+                          const WriteOptions &write_options)
+{
+    if (write_options.derived.empty())
+        return;
+    if (per_image_mode(write_options.mode))
+    {
+        throw std::runtime_error(
+            "Derived labels need the binary or packed mode");
+    }
+    std::vector<std::string_view> names = labels;
+    for (auto &&expression : write_options.derived)
     {
-        if constexpr (sizeof(size_t) == sizeof(unsigned long long))
+        const std::string &name = expression.name();
+        if (name.empty() || name == "." || name == ".." ||
+            name.find_first_of("/\\") != std::string::npos)
         {
-            return m_image_node.attribute("width").as_ullong();
+            throw std::runtime_error("Derived label name \"" + name +
+                                     "\" is not a directory name");
         }
-        else if constexpr (sizeof(size_t) == sizeof(unsigned int))
+        if (std::find(names.begin(), names.end(), name) != names.end())
         {
-            return m_image_node.attribute("width").as_uint();
+            throw std::runtime_error("Derived label \"" + name +
+                                     "\" is already a label or derived "
+                                     "label");
         }
-        else
+        names.push_back(name);
+        for (auto &&label : expression.labels())
         {
-            static_assert("Cannot determine size_t size");
+            if (std::find(labels.begin(), labels.end(), label) ==
+                labels.end())
+            {
+                throw std::runtime_error("Unknown label \"" + label +
+                                         "\" in derived label " +
+                                         expression.name());
+            }
         }
     }
-    size_t height() const noexcept
-    {
-        if constexpr (sizeof(size_t) == sizeof(unsigned long long))
+}
+
+// Top level directories of the output, the labels and derived labels, or
+// the single directory of the per-image modes.
+std::vector<std::string_view>
+output_directories(const std::vector<std::string_view> &labels,
+                   const WriteOptions &write_options)
+{
+    if (per_image_mode(write_options.mode))
+        return {per_image_directory(write_options.mode)};
+    auto result = labels;
+    for (auto &&expression : write_options.derived)
+        result.push_back(expression.name());
+    return result;
+}
+
+// xxh3 of the size and all shapes of `image`, labels by name so that the
+// XML and an index of it hash the same.
+template <typename ImageT, typename LabelId>
+uint64_t annotation_hash(const ImageT &image,
+                         const std::vector<std::string_view> &labels,
+                         const LabelId &label_id)
+{
+    ShapeHasher hasher{image.width(), image.height()};
+    image.for_each_shape(
+        [&](auto &&label, const ShapeData &shape)
         {
-            return m_image_node.attribute("height").as_ullong();
-        }
-        else if constexpr (sizeof(size_t) == sizeof(unsigned int))
+            const uint32_t l = label_id(label);
+            hasher.add(l < labels.size() ? labels[l] : std::string_view{},
+                       shape);
+        });
+    return hasher.digest();
+}
+
+// The annotation hash of `image` for the checksum manifest, 0 without one.
+template <typename ImageT, typename LabelId>
+uint64_t source_hash(const ImageT &image,
+                     const std::vector<std::string_view> &labels,
+                     const LabelId &label_id, const WriteOptions &write_options)
+{
+    return write_options.checksums != nullptr
+               ? annotation_hash(image, labels, label_id)
+               : 0;
+}
+
+// Packed masks of the labels the derived labels reference, by label id.
+// The masks of other labels stay empty.
+using OperandMasks = std::vector<std::vector<uint64_t>>;
+
+// True if a --derive expression references `label`.
+bool is_operand(std::string_view label, const WriteOptions &write_options)
+{
+    for (auto &&expression : write_options.derived)
+    {
+        const auto &operands = expression.labels();
+        if (std::find(operands.begin(), operands.end(), label) !=
+            operands.end())
+            return true;
+    }
+    return false;
+}
+
+// Hands a file to the sink, and to the --checksums manifest.
+void write_file(const std::string &key, const std::vector<uchar> &data,
+                uint64_t source_hash, MaskSink &sink,
+                const WriteOptions &write_options)
+{
+    if (write_options.checksums != nullptr)
+    {
+        write_options.checksums->add(key, data.size(),
+                                     xxh3(data.data(), data.size()),
+                                     source_hash);
+    }
+    sink.write(key, data);
+    metrics().masks_written.add();
+    metrics().bytes_written.add(data.size());
+}
+
+// Writes the derived labels of `image` from the packed masks of their
+// operands.
+template <typename ImageT>
+void write_derived(const ImageT &image,
+                   const std::vector<std::string_view> &labels,
+                   const OperandMasks &packed, uint64_t source_hash,
+                   MaskSink &sink, const WriteOptions &write_options,
+                   PhaseTimer &timer)
+{
+    const OutputMode mode = write_options.mode;
+    auto label_index = [&](std::string_view label)
+    {
+        return (uint32_t)(std::find(labels.begin(), labels.end(), label) -
+                          labels.begin());
+    };
+    std::vector<const uint64_t *> operands;
+    for (auto &&expression : write_options.derived)
+    {
+        operands.clear();
+        for (auto &&label : expression.labels())
+            operands.push_back(packed[label_index(label)].data());
+        const auto bits =
+            expression.evaluate(operands, image.width(), image.height());
+        timer.rendered();
+        std::vector<uchar> data;
+        if (mode == OutputMode::packed)
         {
-            return m_image_node.attribute("height").as_uint();
+            data.assign((const uchar *)bits.data(),
+                        (const uchar *)(bits.data() + bits.size()));
         }
         else
         {
-            static_assert("Cannot determine size_t size");
+            data = encode_png(unpack_spans(bits, (int)image.width(),
+                                           (int)image.height()));
         }
+        timer.encoded();
+        write_file(mask_key(expression.name(), image.filename(), mode), data,
+                   source_hash, sink, write_options);
+        timer.written();
     }
+}
 
-    std::vector<std::string_view> labels() const
+// Writes the masks of the labels [label_begin, label_end) of `image`, or
+// its single file in the per-image modes. `source_hash` is the
+// source_hash() of the whole image, computed once by the caller when the
+// image is split into several tasks. The time spent goes to `times` if it
+// is given.
+//
+// With all labels, the derived labels are written too. The label tasks of
+// a split image instead keep the masks of their operand labels in the
+// `operands` shared by the image, the last of them calls write_derived().
+template <typename ImageT, typename LabelKey, typename LabelId>
+void write_image(const ImageT &image,
+                 const std::vector<std::string_view> &labels,
+                 uint32_t label_begin, uint32_t label_end,
+                 const LabelKey &label_key, const LabelId &label_id,
+                 uint64_t source_hash, MaskSink &sink,
+                 const WriteOptions &write_options,
+                 ImageTimes *times = nullptr,
+                 OperandMasks *operands = nullptr)
+{
+    const OutputMode mode = write_options.mode;
+    PhaseTimer timer{times};
+    if (per_image_mode(mode))
     {
-        std::vector<std::string_view> result;
-        for (Geometry geometry : m_image_node.children())
-        {
-            result.push_back(geometry.label());
-        }
-        return result;
+        auto data = encode_image(image, label_id, labels.size(), mode, timer);
+        write_file(mask_key(per_image_directory(mode), image.filename(), mode),
+                   data, source_hash, sink, write_options);
+        timer.written();
+        return;
     }
 
-    cv::Mat empty_mask() const
+    OperandMasks image_operands;
+    if (label_begin == 0 && label_end == labels.size() &&
+        !write_options.derived.empty())
+    {
+        image_operands.resize(labels.size());
+        operands = &image_operands;
+    }
+    for (uint32_t l = label_begin; l < label_end; ++l)
     {
-        const auto h = height();
-        const auto w = width();
-        return cv::Mat((int)h, (int)w, CV_8UC1, (unsigned char)0);
+        const bool keep =
+            operands != nullptr && is_operand(labels[l], write_options);
+        auto data = encode_mask(image, label_key(l), write_options, timer,
+                                keep ? &(*operands)[l] : nullptr);
+        write_file(mask_key(labels[l], image.filename(), mode), data,
+                   source_hash, sink, write_options);
+        timer.written();
     }
 
-    std::string_view filename() const noexcept
+    if (!image_operands.empty())
     {
-        return m_image_node.attribute("name").as_string();
+        write_derived(image, labels, image_operands, source_hash, sink,
+                      write_options, timer);
     }
+}
 
-    cv::Mat mask_combined(std::string_view label) const
+// Directories the keys of all masks are in, every label directory combined
+// with the distinct subdirectories of the image names, like "car/cam1".
+template <typename ImageAt>
+std::vector<std::string>
+key_directories(size_t image_count, const ImageAt &image_at,
+                const std::vector<std::string_view> &labels)
+{
+    std::set<std::string> subdirectories;
+    for (size_t i = 0; i < image_count; ++i)
     {
-        cv::Mat result = empty_mask();
+        subdirectories.insert(std::filesystem::path(image_at(i).filename())
+                                  .parent_path()
+                                  .generic_string());
+    }
 
-        for (Geometry geo : m_image_node.children())
+    std::vector<std::string> directories;
+    directories.reserve(labels.size() * subdirectories.size());
+    for (auto &&l : labels)
+    {
+        for (auto &&sub : subdirectories)
         {
-            if (geo.label() != label)
-                continue;
-            geo.draw_mask(result);
+            if (sub.empty())
+                directories.emplace_back(l);
+            else
+                directories.push_back(
+                    (std::filesystem::path(l) / sub).generic_string());
         }
-
-        return result;
     }
+    return directories;
+}
 
-    std::vector<cv::Mat> mask(std::string_view label) const
-    {
-        std::vector<cv::Mat> result;
-        std::unordered_map<int, cv::Mat> groups;
-
-        for (Geometry geo : m_image_node.children())
+// Compares the annotated size of every image with its file below `root`,
+// reading only the file headers. At most `max_open_files` files are open at
+// once. Mismatches are reported on stderr, returns their number.
+template <typename ImageAt>
+size_t verify_image_sizes(size_t image_count, const ImageAt &image_at,
+                          const std::filesystem::path &root,
+                          unsigned max_open_files)
+{
+    std::atomic<size_t> mismatches{0};
+    std::atomic<size_t> unreadable{0};
+    std::mutex report_mutex;
+    parallel_for(
+        image_count,
+        [&](size_t i)
         {
-            if (geo.label() != label)
-                continue;
-
-            auto group = geo.group();
-            cv::Mat mat = empty_mask();
-            if (group)
+            const auto image = image_at(i);
+            const auto size = read_image_size(root / image.filename());
+            if (!size)
             {
-                mat = groups.insert({group.value(), mat}).first->second;
+                ++unreadable;
+                std::lock_guard lock{report_mutex};
+                std::cerr << image.filename()
+                          << ": not found or not a PNG/JPEG\n";
+                return;
             }
-            geo.draw_mask(mat);
-            result.push_back(mat);
-        }
+            if (size->width != image.width() ||
+                size->height != image.height())
+            {
+                ++mismatches;
+                std::lock_guard lock{report_mutex};
+                std::cerr << image.filename() << ": annotated "
+                          << image.width() << 'x' << image.height()
+                          << ", file " << size->width << 'x' << size->height
+                          << '\n';
+            }
+        },
+        std::max(max_open_files, 1u));
 
-        return result;
-    }
+    std::cout << "verified " << image_count << " images: " << mismatches
+              << " size mismatches, " << unreadable << " unreadable\n";
+    return mismatches + unreadable;
+}
 
-    std::unordered_map<std::string_view, cv::Mat> masks() const
+// Runs --verify-images-root if it is set. Throws on a mismatch unless
+// --verify-warn-only is given, so nothing is written for a task whose
+// annotations do not fit its images.
+template <typename ImageAt>
+void verify_images(size_t image_count, const ImageAt &image_at,
+                   const WriteOptions &write_options)
+{
+    if (write_options.verify_images_root.empty())
+        return;
+    const size_t failed = verify_image_sizes(
+        image_count, image_at, write_options.verify_images_root,
+        write_options.verify_open_files);
+    if (failed > 0 && !write_options.verify_warn_only)
     {
-        std::unordered_map<std::string_view, cv::Mat> result;
-        std::unordered_map<int, cv::Mat> groups;
+        throw std::runtime_error(
+            std::to_string(failed) +
+            " images do not match their annotations, nothing was written");
+    }
+}
+
+// Cost of rendering all `label_count` masks of an image in the units of the
+// cost model: every mask touches every pixel once when it is cleared and
+// encoded, every vertex is worth a few pixels of rasterization.
+template <typename ImageT>
+double render_cost(const ImageT &image, size_t label_count)
+{
+    return (double)image.width() * (double)image.height() *
+               (double)label_count +
+           16.0 * (double)image.vertex_count();
+}
+
+// Masks [label_begin, label_end) of one image, rendered by one worker.
+struct RenderTask
+{
+    size_t image;
+    uint32_t label_begin;
+    uint32_t label_end;
+};
 
-        const auto h = height();
-        const auto w = width();
+// One task per image, or per label for images that are split. In auto mode
+// an image is split when it costs more than a quarter of a worker's fair
+// share, so a few huge images cannot leave the other workers idle.
+std::vector<RenderTask> plan_tasks(const std::vector<double> &costs,
+                                   uint32_t label_count, unsigned workers,
+                                   Granularity granularity)
+{
+    double total = 0.0;
+    for (double c : costs)
+        total += c;
+    const double quantum = total / (4.0 * std::max(workers, 1u));
 
-        for (Geometry geometry : m_image_node.children())
+    std::vector<RenderTask> tasks;
+    for (size_t i = 0; i < costs.size(); ++i)
+    {
+        const bool split =
+            label_count > 1 &&
+            (granularity == Granularity::label ||
+             (granularity == Granularity::automatic && costs[i] > quantum));
+        if (!split)
         {
-            auto label = geometry.label();
-            auto mat = result
-                           .try_emplace(label, (int)h, (int)w, CV_8UC1,
-                                        (unsigned char)0)
-                           .first->second;
-            auto group = geometry.group();
-            if (group)
-            {
-                mat = groups.try_emplace(group.value(), mat).first->second;
-            }
-            geometry.draw_mask(mat);
+            tasks.push_back({i, 0, label_count});
+            continue;
         }
-        return result;
+        for (uint32_t l = 0; l < label_count; ++l)
+            tasks.push_back({i, l, l + 1});
     }
-};
+    return tasks;
+}
 
-class ImageIterator : public pugi::xml_named_node_iterator
+// Renders every mask into the sink following plan_tasks. `image_at(i)`
+// returns image i and `label_key(l)` identifies label l the way the image
+// type expects it. The label tasks of a split image render from
+// `share(image)`, created by the first of them and dropped by the last.
+template <typename ImageAt, typename LabelKey, typename Share>
+void render_to_sink(size_t image_count, const ImageAt &image_at,
+                    const std::vector<std::string_view> &labels,
+                    const LabelKey &label_key, const Share &share,
+                    MaskSink &sink, const WriteOptions &write_options)
 {
-  public:
-    ImageIterator(const pugi::xml_named_node_iterator &it)
-        : pugi::xml_named_node_iterator{it}
+    const unsigned workers =
+        write_options.jobs != 0
+            ? write_options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+    const auto label_count = (uint32_t)labels.size();
+    const OutputMode mode = write_options.mode;
+
+    check_label_count(label_count, mode);
+    check_derived_labels(labels, write_options);
+    verify_images(image_count, image_at, write_options);
+
+    sink.prepare(key_directories(image_count, image_at,
+                                 output_directories(labels, write_options)));
+
+    using Label = decltype(label_key(0));
+    std::unordered_map<Label, uint32_t> label_ids;
+    for (uint32_t l = 0; l < label_count; ++l)
+        label_ids.emplace(label_key(l), l);
+    auto label_id = [&](const Label &key)
     {
-    }
+        auto it = label_ids.find(key);
+        return it == label_ids.end() ? label_count : it->second;
+    };
 
-    using value_type = Image;
-    using reference = Image;
-    using pointer = Image;
+    // per-image outputs need all labels in one task
+    const Granularity granularity =
+        per_image_mode(mode) ? Granularity::image : write_options.granularity;
 
-    value_type operator*()
+    std::vector<double> costs(image_count);
+    if (granularity == Granularity::automatic)
     {
-        return Image{pugi::xml_named_node_iterator::operator*()};
+        for (size_t i = 0; i < image_count; ++i)
+            costs[i] = render_cost(image_at(i), label_count);
     }
-};
+    const auto tasks =
+        plan_tasks(costs, label_count, workers, granularity);
 
-class CVATMaskGenerator
-{
-  public:
-    static CVATMaskGenerator from_file(std::string_view file)
+    using Shared = typename decltype(share(image_at(0)))::element_type;
+    struct SharedImage
+    {
+        std::once_flag once;
+        std::shared_ptr<Shared> image;
+        uint64_t source_hash = 0;
+        // filled by the label tasks, read by the last one
+        OperandMasks operands;
+        std::atomic<uint32_t> remaining{0};
+    };
+    std::vector<SharedImage> shared(
+        tasks.size() == image_count ? 0 : image_count);
+    for (auto &&task : tasks)
     {
-        pugi::xml_document doc;
-        doc.load_file(file.data());
-        return CVATMaskGenerator(std::move(doc));
+        if (task.label_end - task.label_begin < label_count)
+            shared[task.image].remaining += task.label_end - task.label_begin;
     }
 
-    class ImageRange
-    {
-        std::pair<ImageIterator, ImageIterator> m_p;
+    std::vector<ImageTimes> times(write_options.slowest > 0 ? image_count
+                                                            : 0);
+    metrics().tasks_pending.add((int64_t)tasks.size());
 
-      public:
-        ImageRange(const ImageIterator &f, const ImageIterator &s) : m_p{f, s}
+    parallel_for(
+        tasks.size(),
+        [&](size_t t)
         {
-        }
-        ImageIterator begin() const { return m_p.first; }
-        ImageIterator end() const { return m_p.second; }
-    };
+            ScratchArena::Scope scratch{write_options.scratch_arena};
+            const auto &task = tasks[t];
+            const uint32_t task_labels = task.label_end - task.label_begin;
+            const auto image = image_at(task.image);
+            // index images fault in their pages up front and hand them back
+            // once the last mask is done
+            constexpr bool paged = requires { image.prefetch(); };
+            ImageTimes *image_times =
+                times.empty() ? nullptr : &times[task.image];
+            auto write = [&](const auto &img, uint64_t hash,
+                             OperandMasks *operands = nullptr)
+            {
+                write_image(img, labels, task.label_begin, task.label_end,
+                            label_key, label_id, hash, sink, write_options,
+                            image_times, operands);
+            };
+
+            if (task_labels == label_count)
+            {
+                if constexpr (paged)
+                    image.prefetch();
+                write(image,
+                      source_hash(image, labels, label_id, write_options));
+                if constexpr (paged)
+                    image.release();
+                metrics().images_rendered.add();
+                metrics().tasks_pending.add(-1);
+                return;
+            }
+
+            auto &s = shared[task.image];
+            bool parsed = false;
+            std::call_once(s.once,
+                           [&]
+                           {
+                               if constexpr (paged)
+                                   image.prefetch();
+                               s.image = share(image);
+                               // hashed once for all label tasks
+                               s.source_hash = source_hash(
+                                   *s.image, labels, label_id, write_options);
+                               if (!write_options.derived.empty())
+                                   s.operands.resize(label_count);
+                               parsed = true;
+                           });
+            (parsed ? metrics().shared_image_parses
+                    : metrics().shared_image_reuses)
+                .add();
+            write(*s.image, s.source_hash, &s.operands);
+            if (s.remaining.fetch_sub(task_labels) == task_labels)
+            {
+                // all operand masks are in, no label is rendered twice
+                if (!write_options.derived.empty())
+                {
+                    PhaseTimer timer{image_times};
+                    write_derived(*s.image, labels, s.operands,
+                                  s.source_hash, sink, write_options, timer);
+                    s.operands = {};
+                }
+                s.image.reset();
+                if constexpr (paged)
+                    image.release();
+                metrics().images_rendered.add();
+            }
+            metrics().tasks_pending.add(-1);
+        },
+        workers, write_options.numa);
 
-    ImageRange images() const
+    SlowestImages slowest{write_options.slowest};
+    for (size_t i = 0; i < times.size(); ++i)
+        slowest.add(image_at(i), times[i]);
+    slowest.print(std::cout);
+}
+
+void write_masks(std::string_view xml_file, MaskSink &sink,
+                 const ParseOptions &parse_options = {},
+                 const WriteOptions &write_options = {})
+{
+    const auto parse_start = std::chrono::high_resolution_clock::now();
+    const auto parse_faults = PageFaults::now();
+    const auto parse_counters = PerfCounters::now();
+    auto &&generator = CVATMaskGenerator::from_file(xml_file, parse_options);
+    auto &&labels = generator.labels();
+    PerfCounters::add(PerfStage::load, parse_counters);
+    if (write_options.stats)
     {
-        auto range = m_annotations.children("image");
-        return ImageRange{range.begin(), range.end()};
+        std::cout << "parse time: " << milliseconds_since(parse_start)
+                  << "ms\n";
+        print_page_faults("parse", parse_faults);
     }
 
-    CVATMaskGenerator(pugi::xml_document doc) : m_doc{std::move(doc)}
+    const auto render_start = std::chrono::high_resolution_clock::now();
+    const auto render_faults = PageFaults::now();
+    const std::vector<Image> images(generator.images().begin(),
+                                    generator.images().end());
+    render_to_sink(
+        images.size(), [&](size_t i) { return images[i]; }, labels,
+        [&](uint32_t l) { return labels[l]; },
+        [](const Image &image)
+        { return std::make_shared<const ParsedImage>(image); },
+        sink, write_options);
+    if (write_options.stats)
     {
-        m_annotations = m_doc.child("annotations");
-        m_task = m_annotations.child("meta").child("task");
+        std::cout << "render time: " << milliseconds_since(render_start)
+                  << "ms\n";
+        print_page_faults("render", render_faults);
     }
+}
+
+// The parse options an index is built with.
+IndexOptions index_options(const ParseOptions &parse_options)
+{
+    IndexOptions result;
+    result.simplify_tolerance = parse_options.simplify_tolerance;
+    if (parse_options.label_map != nullptr)
+        result.label_map_hash = parse_options.label_map->hash();
+    return result;
+}
 
-    std::vector<std::string_view> filenames() const
+// Streams the XML into an on-disk index, only one <image> element is held
+// in memory at a time.
+void build_index(std::istream &in, const std::filesystem::path &index_file,
+                 const ParseOptions &parse_options = {})
+{
+    AnnotationStream stream(in);
+    AnnotationIndexWriter writer(index_file, index_options(parse_options));
+
+    pugi::xml_document doc;
+    if (stream.next_meta(doc))
     {
-        std::vector<std::string_view> files;
-        for (const auto &image : m_annotations.children("image"))
+        for (auto &&l :
+             doc.child("meta").child("task").child("labels").children())
         {
-            const auto &attr = image.attribute("name");
-            if (!attr.empty())
-            {
-                files.push_back(attr.as_string());
-            }
+            std::string_view label = l.child("name").text().as_string();
+            if (parse_options.label_map != nullptr)
+                label = parse_options.label_map->map(label);
+            if (!label.empty())
+                writer.add_label(label);
         }
-        return files;
     }
 
-    std::vector<std::string_view> labels() const
+    PointBuffer storage;
+    for (;;)
     {
-        std::vector<std::string_view> result;
-        for (auto &&l : m_task.child("labels").children())
+        const auto load_counters = PerfCounters::now();
+        if (!stream.next_image(doc))
+            break;
+        PerfCounters::add(PerfStage::load, load_counters);
+        const auto image_node = doc.child("image");
+        const Image image{image_node, &parse_options};
+        image.simplify();
+        writer.begin_image(image.filename(), (uint32_t)image.width(),
+                           (uint32_t)image.height());
+        for (pugi::xml_node node : image_node.children())
         {
-            result.push_back(l.child("name").text().as_string());
+            const Geometry geo{node, &parse_options};
+            // <tag> and other elements that are not drawn, or mapped to no
+            // class
+            if (geo.type() == ShapeType::unknown || geo.label().empty())
+                continue;
+            writer.add_shape(geo.data(storage), geo.label(), geo.group());
         }
-        return result;
     }
+    writer.finish();
+}
 
-    std::vector<std::string_view> labels(std::string_view filename) const
+void build_index(std::string_view xml_file,
+                 const std::filesystem::path &index_file,
+                 const ParseOptions &parse_options = {})
+{
+    std::ifstream in(std::string(xml_file), std::ios::binary);
+    if (!in)
     {
-        std::vector<std::string_view> labels;
-        for (const auto &image : m_annotations.children("image"))
+        throw std::runtime_error("Cannot open " + std::string(xml_file));
+    }
+    build_index(in, index_file, parse_options);
+}
+
+// Renders an annotations.xml arriving on `in`, like stdin, while it is still
+// being read. The reading thread cuts out one <image> element at a time and
+// hands it to the workers through a bounded queue, so rendering starts with
+// the first image and only a few images per worker are held in memory.
+// Streamed images are always rendered whole, there is no cost estimate of
+// the whole document to plan label tasks from.
+void write_masks_from_stream(std::istream &in, MaskSink &sink,
+                             const ParseOptions &parse_options = {},
+                             const WriteOptions &write_options = {})
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    const unsigned workers =
+        write_options.jobs != 0
+            ? write_options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+    const OutputMode mode = write_options.mode;
+
+    AnnotationStream stream(in);
+    pugi::xml_document meta;
+    std::vector<std::string_view> labels;
+    if (stream.next_meta(meta))
+    {
+        for (auto &&l :
+             meta.child("meta").child("task").child("labels").children())
         {
-            if (filename != image.attribute("name").as_string())
-            {
-                continue;
-            }
-            for (const auto &geometry : image.children())
-            {
-                labels.push_back(geometry.attribute("label").as_string());
-            }
+            labels.push_back(l.child("name").text().as_string());
         }
-        return labels;
     }
+    if (parse_options.label_map != nullptr)
+        labels = parse_options.label_map->classes(labels);
+    const auto label_count = (uint32_t)labels.size();
+    check_label_count(label_count, mode);
+    check_derived_labels(labels, write_options);
 
-    std::vector<cv::Mat> masks(std::string_view filename,
-                               std::string_view label) const
+    std::unordered_map<std::string_view, uint32_t> label_ids;
+    for (uint32_t l = 0; l < label_count; ++l)
+        label_ids.emplace(labels[l], l);
+    auto label_id = [&](std::string_view label)
     {
-        std::vector<cv::Mat> mats;
-        for (pugi::xml_node image : m_annotations.children("image"))
-        {
-            if (filename != image.attribute("name").as_string())
-            {
-                continue;
-            }
+        auto it = label_ids.find(label);
+        return it == label_ids.end() ? label_count : it->second;
+    };
+    const auto top_directories = output_directories(labels, write_options);
 
-            std::unordered_map<int, cv::Mat> group_ids;
-            const auto width = image.attribute("width").as_int();
-            const auto height = image.attribute("height").as_int();
+    SlowestImages slowest{write_options.slowest};
 
-            for (pugi::xml_node geometry : image.children())
-            {
-                if (label != geometry.attribute("label").as_string())
-                {
-                    continue;
-                }
+    const size_t max_queued = 2 * (size_t)workers;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::unique_ptr<pugi::xml_document>> queue;
+    bool done = false;
+    bool failed = false;
+    auto fail = [&]
+    {
+        {
+            std::lock_guard lock{mutex};
+            done = failed = true;
+        }
+        changed.notify_all();
+    };
 
-                const auto &group_id = geometry.attribute("group_id");
-                cv::Mat mask;
-                if (group_id.empty())
+    std::vector<std::future<void>> futures;
+    for (unsigned w = 0; w < workers; ++w)
+    {
+        futures.push_back(std::async(
+            std::launch::async,
+            [&, w]
+            {
+                if (write_options.numa)
                 {
-                    mask = cv::Mat(height, width, CV_8UC1, (unsigned char)0);
+                    const auto &topology = NumaTopology::system();
+                    topology.pin(topology.node_of(w, workers));
                 }
-                else
+                for (;;)
                 {
-                    if (!group_ids.contains(group_id.as_int()))
+                    std::unique_ptr<pugi::xml_document> doc;
                     {
-                        group_ids.insert(
-                            {group_id.as_int(), cv::Mat(height, width, CV_8UC1,
-                                                        (unsigned char)0)});
+                        std::unique_lock lock{mutex};
+                        changed.wait(lock,
+                                     [&] { return !queue.empty() || done; });
+                        if (queue.empty() || failed)
+                            return;
+                        doc = std::move(queue.front());
+                        queue.pop_front();
+                        metrics().stream_queue_depth.set(
+                            (int64_t)queue.size());
                     }
-                    mask = group_ids[group_id.as_int()];
-                }
-
-                if (strcmp(geometry.name(), "polygon") == 0)
-                {
-                    const std::vector<cv::Point> pts = parse_points(geometry);
-                    cv::fillPoly(mask, pts, (unsigned char)255);
-                }
-                else if (strcmp(geometry.name(), "box") == 0)
-                {
-                    const auto xtl = geometry.attribute("xtl").as_int();
-                    const auto ytl = geometry.attribute("ytl").as_int();
-                    const auto xbr = geometry.attribute("xbr").as_int();
-                    const auto ybr = geometry.attribute("ybr").as_int();
-
-                    cv::rectangle(mask,
-                                  cv::Rect{xtl, ytl, xbr - xtl, ybr - ytl}, 255,
-                                  cv::FILLED);
-                }
-                else if (strcmp(geometry.name(), "points") == 0)
-                {
-                    const std::vector<cv::Point> pts = parse_points(geometry);
-
-                    cv::Mat mat(height, width, CV_8UC1, (unsigned char)0);
-                    for (const auto &p : pts)
+                    changed.notify_all();
+                    try
                     {
-                        cv::circle(mask, p, 0, 255, cv::FILLED);
+                        ScratchArena::Scope scratch{
+                            write_options.scratch_arena};
+                        const Image image{doc->child("image"),
+                                          &parse_options};
+                        image.simplify();
+                        ImageTimes times;
+                        write_image(
+                            image, labels, 0, label_count,
+                            [&](uint32_t l) { return labels[l]; }, label_id,
+                            source_hash(image, labels, label_id,
+                                        write_options),
+                            sink, write_options,
+                            slowest.enabled() ? &times : nullptr);
+                        slowest.add(image, times);
+                        metrics().images_rendered.add();
+                    }
+                    catch (...)
+                    {
+                        fail();
+                        throw;
                     }
                 }
-                else if (strcmp(geometry.name(), "polyline") == 0)
-                {
-                    const std::vector<cv::Point> pts = parse_points(geometry);
-                    cv::polylines(mask, pts, false, 255);
-                }
-                else if (strcmp(geometry.name(), "ellipse") == 0)
-                {
-                    const auto x = geometry.attribute("cx").as_int();
-                    const auto y = geometry.attribute("cy").as_int();
-                    const auto rx = geometry.attribute("rx").as_int();
-                    const auto ry = geometry.attribute("ry").as_int();
-                    const auto rotation_grad =
-                        geometry.attribute("rotation").as_float(0.f);
-                    cv::ellipse(mask, cv::Point(x, y), cv::Size(rx, ry),
-                                rotation_grad, 0, 360, 255, cv::FILLED);
-                }
-                mats.push_back(mask);
-            }
-        }
-        return mats;
+            }));
     }
 
-  private:
-    static std::vector<cv::Point>
-    parse_points(const pugi::xml_node &node_with_point_attr)
+    // the directories of image names are only known as they arrive
+    std::set<std::string> subdirectories;
+    size_t image_count = 0;
+    try
     {
-        const auto ptr_start =
-            node_with_point_attr.attribute("points").as_string();
-        const auto ptr_end = ptr_start + strlen(ptr_start);
-        auto cur = ptr_start;
-        std::vector<cv::Point> pts;
-        while (cur < ptr_end)
+        for (;;)
         {
-            auto x_coord_end = strchr(cur, ',');
-            if (x_coord_end == nullptr)
-                x_coord_end = ptr_end;
-            auto y_coord_end = strchr(cur, ';');
-            y_coord_end = (y_coord_end != nullptr) ? y_coord_end : ptr_end;
+            auto doc = std::make_unique<pugi::xml_document>();
+            const auto load_counters = PerfCounters::now();
+            if (!stream.next_image(*doc))
+                break;
+            PerfCounters::add(PerfStage::load, load_counters);
+            const Image image{doc->child("image")};
+            if (subdirectories
+                    .insert(std::filesystem::path(image.filename())
+                                .parent_path()
+                                .generic_string())
+                    .second)
+            {
+                sink.prepare(key_directories(
+                    1, [&](size_t) { return image; }, top_directories));
+            }
 
-            int x, y;
-            std::from_chars(cur, x_coord_end, x);
-            std::from_chars(x_coord_end + 1,
-                            (y_coord_end == nullptr) ? ptr_end : y_coord_end,
-                            y);
-            cur = y_coord_end + 1;
-            pts.emplace_back(x, y);
+            std::unique_lock lock{mutex};
+            changed.wait(lock,
+                         [&] { return queue.size() < max_queued || failed; });
+            if (failed)
+                break;
+            queue.push_back(std::move(doc));
+            metrics().stream_queue_depth.set((int64_t)queue.size());
+            lock.unlock();
+            changed.notify_one();
+            ++image_count;
         }
-        return pts;
+    }
+    catch (...)
+    {
+        fail();
+        for (auto &&f : futures)
+            f.wait();
+        throw;
     }
 
-    pugi::xml_document m_doc;
-    pugi::xml_node m_annotations;
-    pugi::xml_node m_task;
-};
+    {
+        std::lock_guard lock{mutex};
+        done = true;
+    }
+    changed.notify_all();
+    for (auto &&f : futures)
+        f.get();
 
-void write_masks_to_directory(std::string_view xml_file,
-                              std::filesystem::path output_directory)
+    if (write_options.stats)
+    {
+        std::cout << "streamed " << image_count
+                  << " images, parse and render time: "
+                  << milliseconds_since(start) << "ms\n";
+    }
+    slowest.print(std::cout);
+}
+
+// Renders from an index built by build_index. A fixed number of workers
+// pull images in index order, so only the pages of the images currently
+// being rendered are resident.
+void write_masks_from_index(const AnnotationIndex &index, MaskSink &sink,
+                            const WriteOptions &write_options = {})
 {
-    auto &&generator = CVATMaskGenerator::from_file(xml_file);
-    auto &&labels = generator.labels();
+    const auto labels = index.labels();
 
-    for (auto &&l : labels)
+    render_to_sink(
+        index.image_count(), [&](size_t i) { return index.image(i); },
+        labels, [](uint32_t l) { return l; },
+        [](const AnnotationIndex::Image &image)
+        { return std::make_shared<const AnnotationIndex::Image>(image); },
+        sink, write_options);
+}
+
+// "1h 02m 03s", "2m 03s" or "3.4s".
+std::string format_duration(double seconds)
+{
+    std::ostringstream out;
+    const auto whole = (long long)seconds;
+    if (whole >= 3600)
+    {
+        out << whole / 3600 << "h " << std::setfill('0') << std::setw(2)
+            << whole / 60 % 60 << "m " << std::setw(2) << whole % 60 << 's';
+    }
+    else if (whole >= 60)
     {
-        auto &&label_dir = output_directory / l;
+        out << whole / 60 << "m " << std::setfill('0') << std::setw(2)
+            << whole % 60 << 's';
+    }
+    else
+        out << std::fixed << std::setprecision(1) << seconds << 's';
+    return out.str();
+}
+
+// Decimal units, like the sizes file systems and object stores report.
+std::string format_bytes(double bytes)
+{
+    static constexpr const char *units[] = {"B", "kB", "MB", "GB", "TB",
+                                            "PB"};
+    size_t unit = 0;
+    while (bytes >= 1000.0 && unit + 1 < std::size(units))
+    {
+        bytes /= 1000.0;
+        ++unit;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << bytes << ' '
+        << units[unit];
+    return out.str();
+}
 
-        if (!std::filesystem::exists(label_dir) ||
-            !std::filesystem::is_directory(label_dir))
+// Renders and encodes `sample_size` images spread evenly over the task
+// without writing them and extrapolates the whole task from them. CPU time
+// scales with the cost model of render_cost, output bytes with the pixels
+// of all masks, the file count is exact. Writing to OUTDIR is not part of
+// the estimate.
+template <typename ImageAt, typename LabelKey>
+void estimate_task(size_t image_count, const ImageAt &image_at,
+                   const std::vector<std::string_view> &labels,
+                   const LabelKey &label_key, const WriteOptions &write_options,
+                   size_t sample_size)
+{
+    const unsigned workers =
+        write_options.jobs != 0
+            ? write_options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+    const auto label_count = (uint32_t)labels.size();
+    const OutputMode mode = write_options.mode;
+    check_label_count(label_count, mode);
+    check_derived_labels(labels, write_options);
+
+    using Label = decltype(label_key(0));
+    std::unordered_map<Label, uint32_t> label_ids;
+    for (uint32_t l = 0; l < label_count; ++l)
+        label_ids.emplace(label_key(l), l);
+    auto label_id = [&](const Label &key)
+    {
+        auto it = label_ids.find(key);
+        return it == label_ids.end() ? label_count : it->second;
+    };
+
+    const size_t masks_per_image =
+        per_image_mode(mode) ? 1
+                             : label_count + write_options.derived.size();
+    double total_cost = 0.0;
+    double total_pixels = 0.0;
+    for (size_t i = 0; i < image_count; ++i)
+    {
+        const auto image = image_at(i);
+        total_cost += render_cost(image, label_count);
+        total_pixels += (double)image.width() * (double)image.height();
+    }
+
+    sample_size = std::min(sample_size, image_count);
+    std::vector<size_t> sample(sample_size);
+    for (size_t s = 0; s < sample_size; ++s)
+        sample[s] = s * image_count / sample_size;
+
+    CountingSink sink;
+    std::vector<ImageTimes> times(sample_size);
+    parallel_for(
+        sample_size,
+        [&](size_t s)
         {
-            std::filesystem::create_directories(label_dir);
-        }
+            ScratchArena::Scope scratch{write_options.scratch_arena};
+            const auto image = image_at(sample[s]);
+            write_image(image, labels, 0, label_count, label_key, label_id,
+                        source_hash(image, labels, label_id, write_options),
+                        sink, write_options, &times[s]);
+        },
+        workers, write_options.numa);
+
+    double sample_cost = 0.0;
+    double sample_pixels = 0.0;
+    int64_t render_us = 0;
+    int64_t encode_us = 0;
+    for (size_t s = 0; s < sample_size; ++s)
+    {
+        const auto image = image_at(sample[s]);
+        sample_cost += render_cost(image, label_count);
+        sample_pixels += (double)image.width() * (double)image.height();
+        render_us += times[s].render;
+        encode_us += times[s].encode;
     }
 
-    std::vector<std::future<void>> futures;
+    const double cpu_seconds =
+        sample_cost > 0.0
+            ? (double)(render_us + encode_us) / 1e6 * total_cost / sample_cost
+            : 0.0;
+    const double bytes =
+        sample_pixels > 0.0
+            ? (double)sink.bytes() * total_pixels / sample_pixels
+            : 0.0;
 
-    for (auto &&image : generator.images())
+    std::cout << "dry run, sampled " << sample_size << " of " << image_count
+              << " images\n";
+    if (sample_size > 0)
     {
-        futures.push_back(std::async(
-            std::launch::async,
-            [image, &output_directory, &labels]()
-            {
-                auto &&filename = std::filesystem::path(image.filename());
-                filename = filename.replace_extension(".png");
+        std::cout << "  per image: render "
+                  << render_us / 1000.0 / (double)sample_size
+                  << "ms, encode "
+                  << encode_us / 1000.0 / (double)sample_size << "ms\n";
+    }
+    std::cout << "  estimated CPU time: " << format_duration(cpu_seconds)
+              << "\n  estimated wall time with " << workers
+              << " jobs: " << format_duration(cpu_seconds / workers)
+              << " plus writing\n  files: " << image_count * masks_per_image
+              << "\n  output: " << format_bytes(bytes) << '\n';
+}
+
+void estimate_masks(std::string_view xml_file,
+                    const ParseOptions &parse_options,
+                    const WriteOptions &write_options, size_t sample_size)
+{
+    const auto parse_start = std::chrono::high_resolution_clock::now();
+    auto &&generator = CVATMaskGenerator::from_file(xml_file, parse_options);
+    const auto labels = generator.labels();
+    std::cout << "parse time: " << milliseconds_since(parse_start) << "ms\n";
+
+    const std::vector<Image> images(generator.images().begin(),
+                                    generator.images().end());
+    estimate_task(
+        images.size(), [&](size_t i) { return images[i]; }, labels,
+        [&](uint32_t l) { return labels[l]; }, write_options, sample_size);
+}
+
+void estimate_masks(const AnnotationIndex &index,
+                    const WriteOptions &write_options, size_t sample_size)
+{
+    estimate_task(
+        index.image_count(), [&](size_t i) { return index.image(i); },
+        index.labels(), [](uint32_t l) { return l; }, write_options,
+        sample_size);
+}
+
+// Renders every mask straight into a slot of the shared memory ring
+// `name`, nothing is encoded or copied. `image_at(i)` returns image i and
+// `label_key(l)` identifies label l the way the image type expects it.
+template <typename ImageAt, typename LabelKey>
+void fill_ring(size_t image_count, const ImageAt &image_at,
+               const std::vector<std::string_view> &labels,
+               const LabelKey &label_key, const std::string &name,
+               uint32_t slot_count, const WriteOptions &write_options)
+{
+    verify_images(image_count, image_at, write_options);
+
+    uint64_t capacity = 0;
+    for (size_t i = 0; i < image_count; ++i)
+    {
+        const auto image = image_at(i);
+        capacity = std::max<uint64_t>(capacity, image.width() * image.height());
+    }
 
-                for (auto &&l : labels)
+    ShmRing ring(name, slot_count, capacity, image_count,
+                 (uint32_t)labels.size());
+    try
+    {
+        parallel_for(
+            image_count,
+            [&](size_t i)
+            {
+                ScratchArena::Scope scratch{write_options.scratch_arena};
+                const auto image = image_at(i);
+                const int w = (int)image.width();
+                const int h = (int)image.height();
+                for (uint32_t l = 0; l < labels.size(); ++l)
                 {
-                    auto mat = image.mask_combined(l);
-                    cv::imwrite((output_directory / l / filename).string(),
-                                mat);
+                    auto slot = ring.acquire();
+                    slot.describe((uint32_t)i, image.filename(), l, labels[l],
+                                  (uint32_t)w, (uint32_t)h);
+                    cv::Mat mask(h, w, CV_8UC1, slot.data());
+                    mask.setTo(0);
+                    render_mask(image, label_key(l), write_options, mask);
+                    slot.publish();
+                    metrics().masks_written.add();
+                    metrics().bytes_written.add(mask.total());
                 }
-            }));
+                metrics().images_rendered.add();
+            },
+            write_options.jobs, write_options.numa);
     }
+    catch (...)
+    {
+        ring.finish(false);
+        throw;
+    }
+    ring.finish(true);
+}
 
-    for (auto &&f : futures)
+void write_masks_to_ring(std::string_view xml_file, const std::string &name,
+                         uint32_t slot_count,
+                         const ParseOptions &parse_options = {},
+                         const WriteOptions &write_options = {})
+{
+    auto &&generator = CVATMaskGenerator::from_file(xml_file, parse_options);
+    const auto labels = generator.labels();
+    const std::vector<Image> images(generator.images().begin(),
+                                    generator.images().end());
+    fill_ring(
+        images.size(), [&](size_t i) { return images[i]; }, labels,
+        [&](uint32_t l) { return labels[l]; }, name, slot_count,
+        write_options);
+}
+
+void write_masks_to_ring(const AnnotationIndex &index, const std::string &name,
+                         uint32_t slot_count,
+                         const WriteOptions &write_options = {})
+{
+    fill_ring(
+        index.image_count(), [&](size_t i) { return index.image(i); },
+        index.labels(), [](uint32_t l) { return l; }, name, slot_count,
+        write_options);
+}
+
+struct ManifestOptions
+{
+    // weight by covered pixels instead of number of shapes
+    bool by_pixels = false;
+    // count pixels on a raster of this scale, 0 uses the analytic shape
+    // areas, which count overlapping shapes twice
+    double raster_scale = 0.0;
+};
+
+// Sparse (label id, statistic) pairs of one image.
+template <typename ImageT, typename LabelId>
+std::vector<std::pair<uint32_t, double>>
+image_label_stats(const ImageT &image, size_t label_count,
+                  const LabelId &label_id, const ManifestOptions &options)
+{
+    std::vector<double> stats(label_count, 0.0);
+    if (options.by_pixels && options.raster_scale > 0.0)
+    {
+        const double s = options.raster_scale;
+        std::vector<SpanMask> masks(
+            label_count, SpanMask((int)std::ceil(image.width() * s),
+                                  (int)std::ceil(image.height() * s)));
+        std::vector<cv::Point> storage;
+        image.for_each_shape(
+            [&](auto &&label, const ShapeData &shape)
+            {
+                const uint32_t l = label_id(label);
+                if (l < label_count)
+                    draw_shape(masks[l], scaled_shape(shape, s, storage));
+            });
+        for (size_t l = 0; l < label_count; ++l)
+        {
+            masks[l].finalize();
+            stats[l] = (double)masks[l].area() / (s * s);
+        }
+    }
+    else
+    {
+        image.for_each_shape(
+            [&](auto &&label, const ShapeData &shape)
+            {
+                const uint32_t l = label_id(label);
+                if (l < label_count)
+                    stats[l] += options.by_pixels ? shape_area(shape) : 1.0;
+            });
+    }
+
+    std::vector<std::pair<uint32_t, double>> result;
+    for (uint32_t l = 0; l < label_count; ++l)
+    {
+        if (stats[l] > 0.0)
+            result.emplace_back(l, stats[l]);
+    }
+    return result;
+}
+
+// Writes "image,weight" lines for class-balanced sampling. Every label gets
+// the same total weight, spread over its images in proportion to the
+// statistic, so images with rare labels are drawn more often. The weights
+// are normalized to a mean of 1.
+template <typename ImageAt, typename LabelId>
+void write_sample_manifest(size_t image_count, const ImageAt &image_at,
+                           const std::vector<std::string_view> &labels,
+                           const LabelId &label_id,
+                           const std::string &output_file,
+                           const ManifestOptions &options)
+{
+    std::vector<std::vector<std::pair<uint32_t, double>>> stats(image_count);
+    parallel_for(image_count,
+                 [&](size_t i)
+                 {
+                     ScratchArena::Scope scratch;
+                     stats[i] = image_label_stats(image_at(i), labels.size(),
+                                                  label_id, options);
+                 });
+
+    std::vector<double> totals(labels.size(), 0.0);
+    for (auto &&image_stats : stats)
+    {
+        for (auto &&[l, value] : image_stats)
+            totals[l] += value;
+    }
+
+    std::vector<double> weights(image_count, 0.0);
+    double weight_sum = 0.0;
+    for (size_t i = 0; i < image_count; ++i)
+    {
+        for (auto &&[l, value] : stats[i])
+            weights[i] += value / totals[l];
+        weight_sum += weights[i];
+    }
+    const double normalize =
+        weight_sum > 0.0 ? (double)image_count / weight_sum : 0.0;
+
+    std::ofstream out(output_file);
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write " + output_file);
+    }
+    out << "image,weight\n";
+    for (size_t i = 0; i < image_count; ++i)
+    {
+        out << image_at(i).filename() << ',' << weights[i] * normalize
+            << '\n';
+    }
+
+    for (size_t l = 0; l < labels.size(); ++l)
+    {
+        std::cout << labels[l] << ": " << totals[l]
+                  << (options.by_pixels ? " pixels\n" : " instances\n");
+    }
+}
+
+// An index given in place of a CVAT XML. It has to hold the shapes the XML
+// would give with `parse_options`, it cannot be rebuilt without the XML.
+AnnotationIndex open_current_index(const std::string &file,
+                                   const ParseOptions &parse_options)
+{
+    if (!AnnotationIndex::is_current(file, index_options(parse_options)))
     {
-        f.wait();
+        throw std::runtime_error(
+            file + " was built by another version or with another "
+                   "--simplify or --label-map, rebuild it with --index");
+    }
+    return AnnotationIndex(file);
+}
+
+// `input` is either a CVAT XML or an index built with --index.
+void run_sample_manifest(const std::string &input,
+                         const std::string &output_file,
+                         const ManifestOptions &options,
+                         const ParseOptions &parse_options)
+{
+    if (AnnotationIndex::is_index_file(input))
+    {
+        const auto index = open_current_index(input, parse_options);
+        write_sample_manifest(
+            index.image_count(), [&](size_t i) { return index.image(i); },
+            index.labels(), [](uint32_t l) { return l; }, output_file,
+            options);
+        return;
+    }
+
+    auto &&generator = CVATMaskGenerator::from_file(input, parse_options);
+    const auto labels = generator.labels();
+    std::unordered_map<std::string_view, uint32_t> label_ids;
+    for (uint32_t l = 0; l < labels.size(); ++l)
+    {
+        label_ids.emplace(labels[l], l);
+    }
+    const std::vector<Image> images(generator.images().begin(),
+                                    generator.images().end());
+    write_sample_manifest(
+        images.size(), [&](size_t i) { return images[i]; }, labels,
+        [&](std::string_view label)
+        {
+            auto it = label_ids.find(label);
+            return it == label_ids.end() ? (uint32_t)labels.size()
+                                         : it->second;
+        },
+        output_file, options);
+}
+
+void report_simplification(const SimplificationStats &stats,
+                           const std::string &report_file)
+{
+    const auto entries = stats.entries();
+    size_t before = 0;
+    size_t after = 0;
+    for (auto &&e : entries)
+    {
+        before += e.vertices_before;
+        after += e.vertices_after;
+    }
+    std::cout << "simplified " << entries.size() << " shapes: " << before
+              << " -> " << after << " vertices\n";
+
+    if (report_file.empty())
+        return;
+
+    std::ofstream out(report_file);
+    out << "image,label,type,vertices_before,vertices_after\n";
+    for (auto &&e : entries)
+    {
+        out << e.image << ',' << e.label << ',' << e.type << ','
+            << e.vertices_before << ',' << e.vertices_after << '\n';
+    }
+}
+
+// Prints the images containing `label` at least `min_instances` times.
+// `input` is either a CVAT XML or an index built with --index.
+void run_query(const std::string &input, std::string_view label,
+               size_t min_instances, const ParseOptions &parse_options)
+{
+    if (AnnotationIndex::is_index_file(input))
+    {
+        const auto index = open_current_index(input, parse_options);
+        for (auto &&name : index.images_with_label(label, min_instances))
+        {
+            std::cout << name << '\n';
+        }
+        return;
+    }
+
+    auto &&generator = CVATMaskGenerator::from_file(input, parse_options);
+    for (auto &&name : generator.images_with_label(label, min_instances))
+    {
+        std::cout << name << '\n';
     }
 }
 
@@ -489,20 +1621,402 @@ int main(int argc, char **argv)
 {
     CLI::App app{"CVAT Mask generator\nhttps://github.com/TinyTinni/CVATTools"};
 
+    // not marked as required, they are not needed by the subcommands
     std::string cvat_file = "annoations.xml";
-    app.add_option("CVAT XML", cvat_file, "CVAT XML file")
+    auto cvat_option =
+        app.add_option("CVAT XML", cvat_file,
+                       "CVAT XML file, - reads it from stdin and renders "
+                       "while it arrives")
+            ->check(CLI::ExistingFile | CLI::IsMember({"-"}));
+    std::string output_directory = "./";
+    auto output_option = app.add_option(
+        "OUTDIR", output_directory,
+        "Output directory, http://host[:port]/prefix to PUT the masks to "
+        "an S3-compatible object store, or shm://name to hand raw masks to "
+        "a local consumer through shared memory");
+
+    auto query = app.add_subcommand(
+        "query", "List the images containing a label, one per line");
+    std::string query_input;
+    query->add_option("INPUT", query_input, "CVAT XML file or --index file")
         ->check(CLI::ExistingFile)
         ->required();
-    std::string output_directory = "./";
-    app.add_option("OUTDIR", output_directory, "Output directory")->required();
+    std::string query_label;
+    query->add_option("--label", query_label, "Label to look for")
+        ->required();
+    size_t query_min_count = 1;
+    query->add_option("--min-count", query_min_count,
+                      "Minimum number of shapes of the label in an image");
+
+    auto manifest = app.add_subcommand(
+        "sample-manifest",
+        "Write per-image weights for class-balanced sampling, no masks are "
+        "rendered");
+    std::string manifest_input;
+    manifest
+        ->add_option("INPUT", manifest_input, "CVAT XML file or --index file")
+        ->check(CLI::ExistingFile)
+        ->required();
+    std::string manifest_output;
+    manifest->add_option("OUTPUT", manifest_output, "Manifest CSV file")
+        ->required();
+    ManifestOptions manifest_options;
+    manifest->add_flag("--pixels", manifest_options.by_pixels,
+                       "Weight by covered pixels instead of instance counts");
+    manifest
+        ->add_option("--raster-scale", manifest_options.raster_scale,
+                     "Count pixels on a raster of this scale (e.g. 0.125) "
+                     "instead of using analytic shape areas")
+        ->check(CLI::Range(0.0, 1.0));
+
+    ParseOptions parse_options;
+    app.add_option("--simplify", parse_options.simplify_tolerance,
+                   "Simplify polygons and polylines with the given "
+                   "Douglas-Peucker tolerance in pixels")
+        ->check(CLI::NonNegativeNumber);
+    std::string simplify_report;
+    app.add_option("--simplify-report", simplify_report,
+                   "Write per-shape vertex reduction as CSV to this file");
+
+    std::string index_file;
+    app.add_option("--index", index_file,
+                   "Stream the XML into this on-disk shape index (rebuilt "
+                   "when older than the XML or built with another "
+                   "--simplify or --label-map) and render from it");
+    std::string label_map_file;
+    app.add_option("--label-map", label_map_file,
+                   "Render labels as classes from this file of label,class "
+                   "lines, labels sharing a class share its masks and an "
+                   "empty class drops the label. An --index stores the "
+                   "classes and is rebuilt when the map changes")
+        ->check(CLI::ExistingFile);
+
+    WriteOptions write_options;
+    app.add_option("--granularity", write_options.granularity,
+                   "Split the work per image, per label of an image, or "
+                   "decide per image from its estimated cost")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, Granularity>{
+                {"auto", Granularity::automatic},
+                {"image", Granularity::image},
+                {"label", Granularity::label}},
+            CLI::ignore_case));
+    app.add_option("--mode", write_options.mode,
+                   "binary: a 0/255 PNG per label; class8/class16: a PNG per "
+                   "image with label index + 1 of the topmost shape; "
+                   "bitfield: a raw uint32 mask per image with bit l for "
+                   "label l; packed: a raw 1 bit per pixel mask per label")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, OutputMode>{
+                {"binary", OutputMode::binary},
+                {"class8", OutputMode::class8},
+                {"class16", OutputMode::class16},
+                {"bitfield", OutputMode::bitfield},
+                {"packed", OutputMode::packed}},
+            CLI::ignore_case));
+    app.add_option("--verify-images-root", write_options.verify_images_root,
+                   "Before rendering, compare the annotated image sizes with "
+                   "the PNG/JPEG headers of the images below this directory")
+        ->check(CLI::ExistingDirectory);
+    app.add_option("--verify-open-files", write_options.verify_open_files,
+                   "Maximum number of image files open at once while "
+                   "verifying")
+        ->check(CLI::PositiveNumber);
+    app.add_flag("--verify-warn-only", write_options.verify_warn_only,
+                 "Only report the images --verify-images-root finds, render "
+                 "anyway instead of failing");
+    app.add_flag("--numa", write_options.numa,
+                 "Pin the workers to the NUMA nodes, each node renders its "
+                 "own share of the images into memory local to it");
+    app.add_option("--slowest", write_options.slowest,
+                   "Time rendering, encoding and writing of every image and "
+                   "list the given number of slowest images at the end");
+    bool perf_counters = false;
+    app.add_flag("--perf-counters", perf_counters,
+                 "Count cycles, instructions, cache and branch misses of XML "
+                 "loading, rendering, encoding and writing per thread "
+                 "(Linux perf_event_open)");
+    app.add_flag("--stats", write_options.stats,
+                 "Print the parse and render times and the page faults and "
+                 "kernel time of parsing, rendering and in total");
+    uint16_t metrics_port = 0;
+    app.add_option("--metrics-port", metrics_port,
+                   "Serve Prometheus metrics on "
+                   "http://127.0.0.1:<port>/metrics while running");
+    std::string metrics_file;
+    app.add_option("--metrics-file", metrics_file,
+                   "Rewrite Prometheus metrics into this file for "
+                   "node_exporter's textfile collector while running");
+    unsigned metrics_interval = 10;
+    app.add_option("--metrics-interval", metrics_interval,
+                   "Seconds between rewrites of --metrics-file")
+        ->check(CLI::PositiveNumber);
+    bool use_huge_pages = false;
+    app.add_flag("--huge-pages", use_huge_pages,
+                 "Put masks, the parsed document and the decoded shapes of "
+                 "2 MB and more on huge pages, from the hugetlb pool or as "
+                 "transparent huge pages");
+    std::string checksums_file;
+    app.add_option("--checksums", checksums_file,
+                   "Hash every written file with xxh3 while it is written and "
+                   "store path, size, hash and the hash of its source "
+                   "annotations in this CSV file, sorted by path");
+    std::vector<std::string> derive_definitions;
+    app.add_option("--derive", derive_definitions,
+                   "Also write a mask combined from the labels, like "
+                   "vehicle=car|truck|bus or body=car&~wheel, with | & ~ and "
+                   "parentheses. May be given several times")
+        ->allow_extra_args(false);
+    bool dry_run = false;
+    app.add_flag("--dry-run", dry_run,
+                 "Parse the task and render a sample of images without "
+                 "writing anything, then estimate CPU time, wall time, file "
+                 "count and output size of the whole task");
+    size_t dry_run_sample = 32;
+    app.add_option("--dry-run-sample", dry_run_sample,
+                   "Number of images --dry-run renders")
+        ->check(CLI::PositiveNumber);
+    bool no_arena = false;
+    app.add_flag("--no-arena", no_arena,
+                 "Use the heap instead of arenas for the parsed document and "
+                 "the per-image scratch memory, for comparing timings");
+    app.add_flag("--spans", write_options.span_render,
+                 "Render masks as per-row spans and encode the PNG directly "
+                 "from them");
+    app.add_option("-j,--jobs", write_options.jobs,
+                   "Number of rendering workers (default: one per hardware "
+                   "thread)");
+    unsigned http_connections = 0;
+    app.add_option("--http-connections", http_connections,
+                   "Maximum number of concurrent uploads to an http:// "
+                   "OUTDIR (default: --jobs)");
+    uint32_t shm_slots = 16;
+    app.add_option("--shm-slots", shm_slots,
+                   "Number of masks a shm:// OUTDIR buffers for the consumer")
+        ->check(CLI::PositiveNumber);
 
     auto start = std::chrono::high_resolution_clock::now();
 
     CLI11_PARSE(app, argc, argv);
 
+    parse_options.use_arena = !no_arena;
+    write_options.scratch_arena = !no_arena;
+
+    // the subcommands read the shapes with the same options as rendering
+    LabelMap label_map;
+    if (!label_map_file.empty())
+    {
+        try
+        {
+            label_map = LabelMap::from_file(label_map_file);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what();
+            return 1;
+        }
+        parse_options.label_map = &label_map;
+    }
+
+    if (*query)
+    {
+        try
+        {
+            run_query(query_input, query_label, query_min_count,
+                      parse_options);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what();
+            return 1;
+        }
+        return 0;
+    }
+
+    if (*manifest)
+    {
+        if (manifest_options.raster_scale > 0.0)
+        {
+            manifest_options.by_pixels = true;
+        }
+        try
+        {
+            run_sample_manifest(manifest_input, manifest_output,
+                                manifest_options, parse_options);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what();
+            return 1;
+        }
+        return 0;
+    }
+
+    // a dry run writes nothing and needs no OUTDIR
+    if (!*cvat_option || (!*output_option && !dry_run))
+    {
+        std::cerr << "CVAT XML and OUTDIR are required\n" << app.help();
+        return 1;
+    }
+
+    SimplificationStats simplification_stats;
+    parse_options.simplification_stats = &simplification_stats;
+
+    ChecksumManifest checksums;
+    if (!checksums_file.empty())
+        write_options.checksums = &checksums;
+
+    if (use_huge_pages)
+    {
+        huge_pages::enable(true);
+        cv::Mat::setDefaultAllocator(HugePageMatAllocator::instance());
+        std::ifstream thp("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string thp_mode;
+        std::getline(thp, thp_mode);
+        if (thp_mode.find("[never]") != std::string::npos)
+        {
+            std::cerr << "transparent huge pages are disabled, only a "
+                         "hugetlb pool is used\n";
+        }
+    }
+    if (perf_counters)
+        PerfCounters::enable();
+    const auto start_faults = PageFaults::now();
+
+    const bool from_stdin = cvat_file == "-";
+    if (from_stdin)
+        std::ios::sync_with_stdio(false);
+
     try
     {
-        write_masks_to_directory(cvat_file, output_directory);
+        for (auto &&definition : derive_definitions)
+        {
+            write_options.derived.push_back(
+                LabelExpression::parse(definition));
+        }
+
+        std::unique_ptr<MetricsServer> metrics_server;
+        if (metrics_port != 0)
+            metrics_server = std::make_unique<MetricsServer>(metrics_port);
+        std::unique_ptr<MetricsTextfile> metrics_textfile;
+        if (!metrics_file.empty())
+        {
+            metrics_textfile = std::make_unique<MetricsTextfile>(
+                metrics_file, std::chrono::seconds(metrics_interval));
+        }
+
+        if (from_stdin && !index_file.empty())
+        {
+            build_index(std::cin, index_file, parse_options);
+        }
+        else if (!index_file.empty() &&
+                 (!std::filesystem::exists(index_file) ||
+                  !AnnotationIndex::is_current(index_file,
+                                               index_options(parse_options)) ||
+                  std::filesystem::last_write_time(index_file) <
+                      std::filesystem::last_write_time(cvat_file)))
+        {
+            build_index(cvat_file, index_file, parse_options);
+        }
+
+        if (dry_run)
+        {
+            if (from_stdin && index_file.empty())
+            {
+                throw std::runtime_error(
+                    "--dry-run samples the whole task, use --index to read "
+                    "the XML from stdin");
+            }
+            if (index_file.empty())
+            {
+                estimate_masks(cvat_file, parse_options, write_options,
+                               dry_run_sample);
+            }
+            else
+            {
+                estimate_masks(AnnotationIndex(index_file), write_options,
+                               dry_run_sample);
+            }
+        }
+        else if (output_directory.starts_with("shm://"))
+        {
+            const auto name = output_directory.substr(6);
+            if (!checksums_file.empty())
+            {
+                throw std::runtime_error(
+                    "--checksums hashes written files, shm:// writes none");
+            }
+            if (!write_options.derived.empty())
+            {
+                throw std::runtime_error(
+                    "--derive is not supported for shm://");
+            }
+            if (write_options.mode != OutputMode::binary)
+            {
+                throw std::runtime_error(
+                    "shm:// hands out binary masks, --mode is not supported");
+            }
+            if (from_stdin && index_file.empty())
+            {
+                throw std::runtime_error(
+                    "shm:// needs the size of all images up front, use "
+                    "--index to read the XML from stdin");
+            }
+            if (index_file.empty())
+            {
+                write_masks_to_ring(cvat_file, name, shm_slots, parse_options,
+                                    write_options);
+            }
+            else
+            {
+                write_masks_to_ring(AnnotationIndex(index_file), name,
+                                    shm_slots, write_options);
+            }
+        }
+        else
+        {
+            std::unique_ptr<MaskSink> sink;
+            if (output_directory.starts_with("http://"))
+            {
+                if (http_connections == 0)
+                {
+                    http_connections =
+                        write_options.jobs != 0
+                            ? write_options.jobs
+                            : std::max(1u, std::thread::hardware_concurrency());
+                }
+                sink = std::make_unique<HttpSink>(output_directory,
+                                                  http_connections);
+            }
+            else
+            {
+                sink = std::make_unique<DirectorySink>(output_directory);
+            }
+
+            if (from_stdin && index_file.empty())
+            {
+                if (!write_options.verify_images_root.empty())
+                {
+                    throw std::runtime_error(
+                        "--verify-images-root checks all images before "
+                        "rendering, use --index to read the XML from stdin");
+                }
+                write_masks_from_stream(std::cin, *sink, parse_options,
+                                        write_options);
+            }
+            else if (index_file.empty())
+            {
+                write_masks(cvat_file, *sink, parse_options, write_options);
+            }
+            else
+            {
+                write_masks_from_index(AnnotationIndex(index_file), *sink,
+                                       write_options);
+            }
+        }
+
+        if (!checksums_file.empty() && !dry_run)
+            checksums.write(checksums_file);
     }
     catch (const std::exception &e)
     {
@@ -510,11 +2024,15 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    std::cout << "processing time: "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(
-                     std::chrono::high_resolution_clock::now() - start)
-                     .count()
-              << "ms\n";
+    if (parse_options.simplify_tolerance > 0.0)
+    {
+        report_simplification(simplification_stats, simplify_report);
+    }
+
+    std::cout << "processing time: " << milliseconds_since(start) << "ms\n";
+    if (write_options.stats)
+        print_page_faults("total", start_faults);
+    PerfCounters::report(std::cout);
 
     return 0;
 }
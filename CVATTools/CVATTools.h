@@ -1,8 +1,953 @@
-﻿// CVATParser.h : Include file for standard system include files,
-// or project specific include files.
+﻿// CVATTools.h : CVAT annotation model and mask rendering, shared by the
+// command line tool and the libcvattools C API.
 
 #pragma once
 
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-// TODO: Reference additional headers your program requires here.
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <pugixml.hpp>
+
+#include "Arena.h"
+#include "LabelAlgebra.h"
+#include "Numa.h"
+#include "Raster.h"
+#include "Shape.h"
+#include "SpanMask.h"
+
+// Vertex counts of every simplified shape, filled concurrently by the workers.
+class SimplificationStats
+{
+  public:
+    struct Entry
+    {
+        std::string image;
+        std::string label;
+        std::string type;
+        size_t vertices_before;
+        size_t vertices_after;
+    };
+
+    void add(Entry entry)
+    {
+        std::lock_guard lock{m_mutex};
+        m_entries.push_back(std::move(entry));
+    }
+
+    std::vector<Entry> entries() const
+    {
+        std::lock_guard lock{m_mutex};
+        return m_entries;
+    }
+
+  private:
+    mutable std::mutex m_mutex;
+    std::vector<Entry> m_entries;
+};
+
+// Maps the labels of the task to the classes that are rendered, several
+// labels may share a class. Labels mapped to an empty class are dropped,
+// labels that are not listed keep their name.
+class LabelMap
+{
+    struct Hash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const noexcept
+        {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+    std::unordered_map<std::string, std::string, Hash, std::equal_to<>>
+        m_classes;
+
+  public:
+    // Reads "label,class" lines, the label is everything before the last
+    // comma. Empty lines and lines starting with # are skipped.
+    static LabelMap from_file(const std::filesystem::path &file)
+    {
+        std::ifstream in(file);
+        if (!in)
+            throw std::runtime_error("Cannot open " + file.string());
+        LabelMap result;
+        std::string line;
+        for (size_t number = 1; std::getline(in, line); ++number)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty() || line[0] == '#')
+                continue;
+            const size_t comma = line.rfind(',');
+            if (comma == std::string::npos)
+            {
+                throw std::runtime_error(file.string() + ":" +
+                                         std::to_string(number) +
+                                         ": expected label,class");
+            }
+            result.m_classes[line.substr(0, comma)] = line.substr(comma + 1);
+        }
+        return result;
+    }
+
+    // Class of `label`, empty if it is dropped.
+    std::string_view map(std::string_view label) const noexcept
+    {
+        auto it = m_classes.find(label);
+        return it == m_classes.end() ? label : std::string_view(it->second);
+    }
+
+    // FNV-1a of the label,class pairs in label order, the same for maps
+    // with the same pairs. Never 0, which IndexOptions uses for no map.
+    uint64_t hash() const noexcept
+    {
+        std::vector<const std::pair<const std::string, std::string> *> pairs;
+        pairs.reserve(m_classes.size());
+        for (auto &&pair : m_classes)
+            pairs.push_back(&pair);
+        std::sort(pairs.begin(), pairs.end(),
+                  [](auto *l, auto *r) { return l->first < r->first; });
+
+        uint64_t result = 0xcbf29ce484222325ull;
+        auto add = [&](std::string_view s)
+        {
+            // the terminating 0 keeps "a,bc" and "ab,c" apart
+            for (char c : s)
+                result = (result ^ (unsigned char)c) * 0x100000001b3ull;
+            result *= 0x100000001b3ull;
+        };
+        for (auto *pair : pairs)
+        {
+            add(pair->first);
+            add(pair->second);
+        }
+        return result != 0 ? result : 1;
+    }
+
+    // Distinct classes of `labels`, in the order of their first label.
+    std::vector<std::string_view>
+    classes(const std::vector<std::string_view> &labels) const
+    {
+        std::vector<std::string_view> result;
+        for (auto &&label : labels)
+        {
+            const auto c = map(label);
+            if (!c.empty() &&
+                std::find(result.begin(), result.end(), c) == result.end())
+                result.push_back(c);
+        }
+        return result;
+    }
+};
+
+struct ParseOptions
+{
+    // Douglas-Peucker tolerance in pixels, 0 disables simplification.
+    double simplify_tolerance = 0.0;
+    SimplificationStats *simplification_stats = nullptr;
+    // if set, shapes take the class of their label instead of the label
+    const LabelMap *label_map = nullptr;
+    // Load the document into a DocumentArena and decode points into the
+    // workers' ScratchArena.
+    bool use_arena = true;
+};
+
+class Geometry
+{
+    pugi::xml_node m_geometry;
+    const ParseOptions *m_options;
+
+    static void parse_points(const pugi::xml_node &node_with_point_attr,
+                             PointBuffer &pts)
+    {
+        const auto ptr_start =
+            node_with_point_attr.attribute("points").as_string();
+        const auto ptr_end = ptr_start + strlen(ptr_start);
+        auto cur = ptr_start;
+        // sized up front, growing would leave the old buffers behind in a
+        // scratch arena
+        pts.clear();
+        pts.reserve((size_t)std::count(ptr_start, ptr_end, ';') + 1);
+        while (cur < ptr_end)
+        {
+            auto x_coord_end = strchr(cur, ',');
+            if (x_coord_end == nullptr)
+                x_coord_end = ptr_end;
+            auto y_coord_end = strchr(cur, ';');
+            y_coord_end = (y_coord_end != nullptr) ? y_coord_end : ptr_end;
+
+            int x, y;
+            std::from_chars(cur, x_coord_end, x);
+            std::from_chars(x_coord_end + 1,
+                            (y_coord_end == nullptr) ? ptr_end : y_coord_end,
+                            y);
+            cur = y_coord_end + 1;
+            pts.emplace_back(x, y);
+        }
+    }
+
+  public:
+    Geometry(pugi::xml_node geometry_node,
+             const ParseOptions *options = nullptr)
+        : m_geometry{std::move(geometry_node)}, m_options{options}
+    {
+    }
+
+    std::optional<unsigned> group() const noexcept
+    {
+        auto g = m_geometry.attribute("group_id");
+        if (g.empty())
+            return std::nullopt;
+        return g.as_uint();
+    }
+
+    // Label of the shape, its class with a label map.
+    std::string_view label() const noexcept
+    {
+        const std::string_view label =
+            m_geometry.attribute("label").as_string();
+        if (m_options != nullptr && m_options->label_map != nullptr)
+            return m_options->label_map->map(label);
+        return label;
+    }
+
+    ShapeType type() const noexcept { return shape_type(m_geometry.name()); }
+
+    // Drops the nearly collinear vertices of a polygon or polyline if the
+    // options enable it. The simplified points replace the points attribute
+    // in the document, so every later decode parses them instead of
+    // simplifying again, and the stats get one entry per shape.
+    void simplify() const
+    {
+        const ShapeType t = type();
+        if (m_options == nullptr || m_options->simplify_tolerance <= 0.0 ||
+            (t != ShapeType::polygon && t != ShapeType::polyline))
+            return;
+
+        const bool closed = t == ShapeType::polygon;
+        const size_t min_vertices = closed ? 3 : 2;
+        PointBuffer pts;
+        parse_points(m_geometry, pts);
+        if (pts.size() <= min_vertices)
+            return;
+
+        std::vector<cv::Point> simplified;
+        cv::approxPolyDP(cv::Mat((int)pts.size(), 1, CV_32SC2, pts.data()),
+                         simplified, m_options->simplify_tolerance, closed);
+        // never collapse a shape into something that draws differently
+        if (simplified.size() < min_vertices)
+            return;
+
+        if (m_options->simplification_stats != nullptr)
+        {
+            m_options->simplification_stats->add(
+                {m_geometry.parent().attribute("name").as_string(),
+                 m_geometry.attribute("label").as_string(), m_geometry.name(),
+                 pts.size(), simplified.size()});
+        }
+
+        // "x,y;x,y", the integers parse_points() reads back
+        std::string text;
+        text.reserve(simplified.size() * 10);
+        auto append = [&](int value)
+        {
+            char number[16];
+            text.append(number,
+                        std::to_chars(number, std::end(number), value).ptr);
+        };
+        for (auto &&p : simplified)
+        {
+            if (!text.empty())
+                text += ';';
+            append(p.x);
+            text += ',';
+            append(p.y);
+        }
+        m_geometry.attribute("points").set_value(text.c_str());
+    }
+
+    // Decodes the shape, its points are kept alive by `storage`.
+    ShapeData data(PointBuffer &storage) const
+    {
+        ShapeData shape;
+        shape.type = type();
+        shape.z_order = m_geometry.attribute("z_order").as_int();
+        switch (shape.type)
+        {
+        case ShapeType::polygon:
+        case ShapeType::polyline:
+        case ShapeType::points:
+            parse_points(m_geometry, storage);
+            break;
+        case ShapeType::box:
+            shape.values[0] = m_geometry.attribute("xtl").as_int();
+            shape.values[1] = m_geometry.attribute("ytl").as_int();
+            shape.values[2] = m_geometry.attribute("xbr").as_int();
+            shape.values[3] = m_geometry.attribute("ybr").as_int();
+            break;
+        case ShapeType::ellipse:
+            shape.values[0] = m_geometry.attribute("cx").as_int();
+            shape.values[1] = m_geometry.attribute("cy").as_int();
+            shape.values[2] = m_geometry.attribute("rx").as_int();
+            shape.values[3] = m_geometry.attribute("ry").as_int();
+            shape.rotation = m_geometry.attribute("rotation").as_float(0.f);
+            break;
+        case ShapeType::unknown:
+            break;
+        }
+        shape.points = storage;
+        return shape;
+    }
+
+    void draw_mask(cv::Mat &in_out) const noexcept
+    {
+        PointBuffer storage{ScratchArena::resource()};
+        draw_shape(in_out, data(storage));
+    }
+
+    void draw_spans(SpanMask &in_out) const
+    {
+        PointBuffer storage{ScratchArena::resource()};
+        draw_shape(in_out, data(storage));
+    }
+};
+
+class Image
+{
+    pugi::xml_node m_image_node;
+    const ParseOptions *m_options;
+
+  public:
+    Image(pugi::xml_node n, const ParseOptions *options = nullptr)
+        : m_image_node{std::move(n)}, m_options{options}
+    {
+    }
+    size_t width() const noexcept
+    {
+        if constexpr (sizeof(size_t) == sizeof(unsigned long long))
+        {
+            return m_image_node.attribute("width").as_ullong();
+        }
+        else if constexpr (sizeof(size_t) == sizeof(unsigned int))
+        {
+            return m_image_node.attribute("width").as_uint();
+        }
+        else
+        {
+            static_assert("Cannot determine size_t size");
+        }
+    }
+    size_t height() const noexcept
+    {
+        if constexpr (sizeof(size_t) == sizeof(unsigned long long))
+        {
+            return m_image_node.attribute("height").as_ullong();
+        }
+        else if constexpr (sizeof(size_t) == sizeof(unsigned int))
+        {
+            return m_image_node.attribute("height").as_uint();
+        }
+        else
+        {
+            static_assert("Cannot determine size_t size");
+        }
+    }
+
+    // Shapes that are drawn, as an index stores them: no <tag> or other
+    // elements and no labels a label map drops.
+    size_t shape_count() const noexcept
+    {
+        return (size_t)std::count_if(
+            m_image_node.children().begin(), m_image_node.children().end(),
+            [&](pugi::xml_node node)
+            {
+                const Geometry geometry{node, m_options};
+                return geometry.type() != ShapeType::unknown &&
+                       !geometry.label().empty();
+            });
+    }
+
+    // Simplifies the shapes in the document, see Geometry::simplify().
+    // Called once per image, before its shapes are decoded.
+    void simplify() const
+    {
+        for (pugi::xml_node node : m_image_node.children())
+            Geometry{node, m_options}.simplify();
+    }
+
+    // Number of vertices over all shapes, counted without parsing them.
+    size_t vertex_count() const noexcept
+    {
+        size_t result = 0;
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            const char *points = node.attribute("points").as_string();
+            result += 1 + (size_t)std::count(points, points + strlen(points),
+                                             ';');
+        }
+        return result;
+    }
+
+    // Calls f(label, ShapeData) for every shape of the image.
+    template <typename F> void for_each_shape(F &&f) const
+    {
+        PointBuffer storage{ScratchArena::resource()};
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            const Geometry geo{node, m_options};
+            f(geo.label(), geo.data(storage));
+        }
+    }
+
+    std::vector<std::string_view> labels() const
+    {
+        std::vector<std::string_view> result;
+        for (Geometry geometry : m_image_node.children())
+        {
+            result.push_back(geometry.label());
+        }
+        return result;
+    }
+
+    cv::Mat empty_mask() const
+    {
+        const auto h = height();
+        const auto w = width();
+        return cv::Mat((int)h, (int)w, CV_8UC1, (unsigned char)0);
+    }
+
+    std::string_view filename() const noexcept
+    {
+        return m_image_node.attribute("name").as_string();
+    }
+
+    cv::Mat mask_combined(std::string_view label) const
+    {
+        cv::Mat result = empty_mask();
+
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            Geometry geo{node, m_options};
+            if (geo.label() != label)
+                continue;
+            geo.draw_mask(result);
+        }
+
+        return result;
+    }
+
+    // Union of all shapes of the label as sorted per-row spans.
+    SpanMask spans_combined(std::string_view label) const
+    {
+        SpanMask result((int)width(), (int)height());
+
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            Geometry geo{node, m_options};
+            if (geo.label() != label)
+                continue;
+            geo.draw_spans(result);
+        }
+
+        result.finalize();
+        return result;
+    }
+
+    std::vector<cv::Mat> mask(std::string_view label) const
+    {
+        std::vector<cv::Mat> result;
+        std::unordered_map<int, cv::Mat> groups;
+
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            Geometry geo{node, m_options};
+            if (geo.label() != label)
+                continue;
+
+            auto group = geo.group();
+            cv::Mat mat = empty_mask();
+            if (group)
+            {
+                mat = groups.insert({group.value(), mat}).first->second;
+            }
+            geo.draw_mask(mat);
+            result.push_back(mat);
+        }
+
+        return result;
+    }
+
+    std::unordered_map<std::string_view, cv::Mat> masks() const
+    {
+        std::unordered_map<std::string_view, cv::Mat> result;
+        std::unordered_map<int, cv::Mat> groups;
+
+        const auto h = height();
+        const auto w = width();
+
+        for (pugi::xml_node node : m_image_node.children())
+        {
+            Geometry geometry{node, m_options};
+            auto label = geometry.label();
+            auto mat = result
+                           .try_emplace(label, (int)h, (int)w, CV_8UC1,
+                                        (unsigned char)0)
+                           .first->second;
+            auto group = geometry.group();
+            if (group)
+            {
+                mat = groups.try_emplace(group.value(), mat).first->second;
+            }
+            geometry.draw_mask(mat);
+        }
+        return result;
+    }
+};
+
+// An image with all shapes decoded once, so that several workers can render
+// different labels of it without parsing the XML again.
+class ParsedImage
+{
+    size_t m_width;
+    size_t m_height;
+    std::string_view m_filename;
+    std::vector<std::string_view> m_labels;
+    std::vector<ShapeData> m_shapes;
+    // owned by the heap, not by the parsing worker's scratch arena
+    std::vector<PointBuffer> m_points;
+
+  public:
+    explicit ParsedImage(const Image &image)
+        : m_width{image.width()}, m_height{image.height()},
+          m_filename{image.filename()}
+    {
+        image.for_each_shape(
+            [&](std::string_view label, const ShapeData &shape)
+            {
+                m_labels.push_back(label);
+                m_points.emplace_back(shape.points.begin(), shape.points.end(),
+                                      std::pmr::get_default_resource());
+                m_shapes.push_back(shape);
+                m_shapes.back().points = m_points.back();
+            });
+    }
+    ParsedImage(const ParsedImage &) = delete;
+    ParsedImage &operator=(const ParsedImage &) = delete;
+
+    size_t width() const noexcept { return m_width; }
+    size_t height() const noexcept { return m_height; }
+    std::string_view filename() const noexcept { return m_filename; }
+
+    template <typename F> void for_each_shape(F &&f) const
+    {
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+            f(m_labels[i], m_shapes[i]);
+    }
+
+    cv::Mat mask_combined(std::string_view label) const
+    {
+        cv::Mat result((int)m_height, (int)m_width, CV_8UC1,
+                       (unsigned char)0);
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+        {
+            if (m_labels[i] == label)
+                draw_shape(result, m_shapes[i]);
+        }
+        return result;
+    }
+
+    SpanMask spans_combined(std::string_view label) const
+    {
+        SpanMask result((int)m_width, (int)m_height);
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+        {
+            if (m_labels[i] == label)
+                draw_shape(result, m_shapes[i]);
+        }
+        result.finalize();
+        return result;
+    }
+};
+
+class ImageIterator : public pugi::xml_named_node_iterator
+{
+    const ParseOptions *m_options;
+
+  public:
+    ImageIterator(const pugi::xml_named_node_iterator &it,
+                  const ParseOptions *options = nullptr)
+        : pugi::xml_named_node_iterator{it}, m_options{options}
+    {
+    }
+
+    using value_type = Image;
+    using reference = Image;
+    using pointer = Image;
+
+    value_type operator*()
+    {
+        return Image{pugi::xml_named_node_iterator::operator*(), m_options};
+    }
+};
+
+class CVATMaskGenerator
+{
+  public:
+    static CVATMaskGenerator from_file(std::string_view file,
+                                       ParseOptions options = {})
+    {
+        auto arena =
+            options.use_arena ? std::make_unique<DocumentArena>() : nullptr;
+        pugi::xml_document doc;
+        {
+            DocumentArena::Scope scope{arena.get()};
+            doc.load_file(file.data());
+        }
+        CVATMaskGenerator result(std::move(doc), options);
+        result.m_arena = std::move(arena);
+        return result;
+    }
+
+    class ImageRange
+    {
+        std::pair<ImageIterator, ImageIterator> m_p;
+
+      public:
+        ImageRange(const ImageIterator &f, const ImageIterator &s) : m_p{f, s}
+        {
+        }
+        ImageIterator begin() const { return m_p.first; }
+        ImageIterator end() const { return m_p.second; }
+    };
+
+    ImageRange images() const
+    {
+        auto range = m_annotations.children("image");
+        return ImageRange{{range.begin(), &m_parse_options},
+                          {range.end(), &m_parse_options}};
+    }
+
+    CVATMaskGenerator(pugi::xml_document doc, ParseOptions options = {})
+        : m_doc{std::move(doc)}, m_parse_options{options}
+    {
+        m_annotations = m_doc.child("annotations");
+        m_task = m_annotations.child("meta").child("task");
+        for (auto &&image : images())
+            image.simplify();
+    }
+
+    std::vector<std::string_view> filenames() const
+    {
+        std::vector<std::string_view> files;
+        for (const auto &image : m_annotations.children("image"))
+        {
+            const auto &attr = image.attribute("name");
+            if (!attr.empty())
+            {
+                files.push_back(attr.as_string());
+            }
+        }
+        return files;
+    }
+
+    // Labels of the task, or their distinct classes with a label map.
+    std::vector<std::string_view> labels() const
+    {
+        std::vector<std::string_view> result;
+        for (auto &&l : m_task.child("labels").children())
+        {
+            result.push_back(l.child("name").text().as_string());
+        }
+        if (m_parse_options.label_map != nullptr)
+            return m_parse_options.label_map->classes(result);
+        return result;
+    }
+
+    std::vector<std::string_view> labels(std::string_view filename) const
+    {
+        std::vector<std::string_view> labels;
+        for (const auto &image : m_annotations.children("image"))
+        {
+            if (filename != image.attribute("name").as_string())
+            {
+                continue;
+            }
+            for (const auto &geometry : image.children())
+            {
+                labels.push_back(
+                    Geometry{geometry, &m_parse_options}.label());
+            }
+        }
+        return labels;
+    }
+
+    std::vector<cv::Mat> masks(std::string_view filename,
+                               std::string_view label) const
+    {
+        std::vector<cv::Mat> mats;
+        for (pugi::xml_node image : m_annotations.children("image"))
+        {
+            if (filename != image.attribute("name").as_string())
+            {
+                continue;
+            }
+
+            auto image_mats = Image{image, &m_parse_options}.mask(label);
+            mats.insert(mats.end(), image_mats.begin(), image_mats.end());
+        }
+        return mats;
+    }
+
+    // Images with at least `min_instances` shapes of the label, answered
+    // from an inverted index built on the first call.
+    std::vector<std::string_view>
+    images_with_label(std::string_view label, size_t min_instances = 1) const
+    {
+        std::call_once(m_label_index->built, [this] { build_label_index(); });
+        const auto &label_images = m_label_index->images;
+        std::vector<std::string_view> result;
+        auto it = label_images.find(label);
+        if (it == label_images.end())
+            return result;
+
+        for (auto &&[image, instances] : it->second)
+        {
+            if (instances >= min_instances)
+                result.push_back(image.attribute("name").as_string());
+        }
+        return result;
+    }
+
+  private:
+    void build_label_index() const
+    {
+        std::unordered_map<std::string_view, unsigned> counts;
+        for (pugi::xml_node image : m_annotations.children("image"))
+        {
+            counts.clear();
+            for (pugi::xml_node geometry : image.children())
+            {
+                ++counts[Geometry{geometry, &m_parse_options}.label()];
+            }
+            for (auto &&[label, instances] : counts)
+            {
+                m_label_index->images[label].push_back({image, instances});
+            }
+        }
+    }
+
+    // declared before m_doc, its memory has to outlive the document
+    std::unique_ptr<DocumentArena> m_arena;
+    pugi::xml_document m_doc;
+    pugi::xml_node m_annotations;
+    pugi::xml_node m_task;
+    ParseOptions m_parse_options;
+    struct LabelIndex
+    {
+        std::once_flag built;
+        // label -> images containing it and the number of its shapes there
+        std::unordered_map<std::string_view,
+                           std::vector<std::pair<pugi::xml_node, unsigned>>>
+            images;
+    };
+    // behind a pointer, the generator stays movable
+    std::unique_ptr<LabelIndex> m_label_index =
+        std::make_unique<LabelIndex>();
+};
+
+// How the work is split between the workers.
+enum class Granularity
+{
+    // decide per image from the cost model
+    automatic,
+    // one task renders all labels of an image
+    image,
+    // one task per label of an image
+    label,
+};
+
+// What is rendered for every image.
+enum class OutputMode
+{
+    // one 0/255 mask per label
+    binary,
+    // one mask per image with label index + 1 of the topmost shape
+    class8,
+    class16,
+    // one uint32 mask per image, bit l is set where label l is
+    bitfield,
+    // one mask per label with one bit per pixel
+    packed,
+};
+
+class ChecksumManifest;
+
+struct WriteOptions
+{
+    // Rasterize into spans and encode the PNG from them instead of going
+    // through a dense cv::Mat.
+    bool span_render = false;
+    // number of rendering workers, 0 uses one per hardware thread
+    unsigned jobs = 0;
+    // decode the points of every image into the worker's ScratchArena
+    bool scratch_arena = true;
+    Granularity granularity = Granularity::automatic;
+    OutputMode mode = OutputMode::binary;
+    // if set, the annotated image sizes are checked against the headers of
+    // the image files below this directory before rendering
+    std::string verify_images_root;
+    // files opened at once while verifying
+    unsigned verify_open_files = 64;
+    // report mismatches found while verifying instead of failing
+    bool verify_warn_only = false;
+    // pin the workers to NUMA nodes and split the images between the nodes
+    bool numa = false;
+    // number of slowest images to report, 0 does not time images
+    size_t slowest = 0;
+    // print the time of every phase
+    bool stats = false;
+    // if set, every written file is hashed into it
+    ChecksumManifest *checksums = nullptr;
+    // masks combined from the labels, written next to them in the binary
+    // and packed modes
+    std::vector<LabelExpression> derived;
+};
+
+// Runs f(i) for every i in [0, count) on `workers` threads, 0 uses one per
+// hardware thread. With `numa`, see numa_parallel_for.
+template <typename F>
+void parallel_for(size_t count, F &&f, unsigned workers = 0,
+                  bool numa = false)
+{
+    if (numa)
+    {
+        numa_parallel_for(count, std::forward<F>(f), workers);
+        return;
+    }
+    std::atomic<size_t> next{0};
+    std::vector<std::future<void>> futures;
+    if (workers == 0)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned w = 0; w < workers; ++w)
+    {
+        futures.push_back(std::async(std::launch::async,
+                                     [&]()
+                                     {
+                                         for (size_t i = next++; i < count;
+                                              i = next++)
+                                         {
+                                             f(i);
+                                         }
+                                     }));
+    }
+
+    for (auto &&fu : futures)
+    {
+        fu.get();
+    }
+}
+
+// Renders the mask of `label` into the zeroed, equally sized 8 bit `out`.
+template <typename ImageT, typename Label>
+void render_mask(const ImageT &image, const Label &label,
+                 const WriteOptions &write_options, cv::Mat &out)
+{
+    if (write_options.span_render)
+    {
+        paint<SetPixel>(image.spans_combined(label),
+                        Raster<uint8_t>{out.ptr(), out.step1()},
+                        (uint8_t)255);
+        return;
+    }
+    image.for_each_shape(
+        [&](auto &&l, const ShapeData &shape)
+        {
+            if (l == label)
+                draw_shape(out, shape);
+        });
+}
+
+// Label index + 1 of the topmost shape at every pixel, 0 for background.
+// `label_id` maps the label of a shape to its index, shapes of labels with
+// an index of `label_count` or more are skipped. Pixel is uint8_t or
+// uint16_t.
+template <typename Pixel, typename ImageT, typename LabelId>
+cv::Mat render_classes(const ImageT &image, const LabelId &label_id,
+                       size_t label_count)
+{
+    const int w = (int)image.width();
+    const int h = (int)image.height();
+    cv::Mat result(h, w, cv::DataType<Pixel>::type, cv::Scalar(0));
+    cv::Mat depth(h, w, CV_32SC1, cv::Scalar(INT32_MIN));
+    const Raster<Pixel> out{result.ptr<Pixel>(), result.step1()};
+    const Raster<int32_t> depth_out{depth.ptr<int32_t>(), depth.step1()};
+
+    // not finalized, overlapping spans of one shape paint the same value
+    SpanMask spans(w, h);
+    image.for_each_shape(
+        [&](auto &&label, const ShapeData &shape)
+        {
+            const uint32_t l = label_id(label);
+            if (l >= label_count)
+                return;
+            spans.clear();
+            draw_shape(spans, shape);
+            paint_max_z(spans, out, depth_out, (Pixel)(l + 1), shape.z_order);
+        });
+    return result;
+}
+
+// Bit l of a pixel is set where a shape of label l is, label_count is at
+// most 32. The result is CV_32SC1 holding the uint32 bits.
+template <typename ImageT, typename LabelId>
+cv::Mat render_bitfield(const ImageT &image, const LabelId &label_id,
+                        size_t label_count)
+{
+    const int w = (int)image.width();
+    const int h = (int)image.height();
+    cv::Mat result(h, w, CV_32SC1, cv::Scalar(0));
+    const Raster<uint32_t> out{(uint32_t *)result.data, result.step1()};
+
+    SpanMask spans(w, h);
+    image.for_each_shape(
+        [&](auto &&label, const ShapeData &shape)
+        {
+            const uint32_t l = label_id(label);
+            if (l >= label_count)
+                return;
+            spans.clear();
+            draw_shape(spans, shape);
+            paint<OrPixel>(spans, out, uint32_t(1) << l);
+        });
+    return result;
+}
+
+// Mask of `label` with one bit per pixel, rows of (width + 63) / 64 words,
+// pixel x is bit x % 64 of word x / 64.
+template <typename ImageT, typename Label>
+std::vector<uint64_t> render_packed(const ImageT &image, const Label &label)
+{
+    const size_t words_per_row = (image.width() + 63) / 64;
+    std::vector<uint64_t> result(words_per_row * image.height(), 0);
+    paint_bits(image.spans_combined(label),
+               Raster<uint64_t>{result.data(), words_per_row});
+    return result;
+}
@@ -0,0 +1,118 @@
+// Checksums.h : xxh3 hashes of the written files and of the annotations
+// they were rendered from.
+//
+// Workers hash every encoded file right before handing it to the sink,
+// while it is still in cache, so verifying an output tree needs no second
+// pass over it. The annotation hash covers the image size and all of its
+// decoded shapes, so files rendered from unchanged annotations can be
+// expected to hash the same again.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#include "Shape.h"
+
+inline uint64_t xxh3(const void *data, size_t size)
+{
+    return XXH3_64bits(data, size);
+}
+
+// Incremental xxh3 of the shapes of one image, in their order.
+class ShapeHasher
+{
+    XXH3_state_t m_state;
+
+    template <typename T> void update(const T &value)
+    {
+        XXH3_64bits_update(&m_state, &value, sizeof(value));
+    }
+
+  public:
+    ShapeHasher(uint64_t width, uint64_t height)
+    {
+        XXH3_64bits_reset(&m_state);
+        update(width);
+        update(height);
+    }
+    ShapeHasher(const ShapeHasher &) = delete;
+    ShapeHasher &operator=(const ShapeHasher &) = delete;
+
+    void add(std::string_view label, const ShapeData &shape)
+    {
+        update((uint64_t)label.size());
+        XXH3_64bits_update(&m_state, label.data(), label.size());
+        update((int32_t)shape.type);
+        update((int32_t)shape.z_order);
+        update(shape.values);
+        update(shape.rotation);
+        update((uint64_t)shape.points.size());
+        for (auto &&p : shape.points)
+        {
+            update((int32_t)p.x);
+            update((int32_t)p.y);
+        }
+    }
+
+    uint64_t digest() const { return XXH3_64bits_digest(&m_state); }
+};
+
+// Size and hashes of every written file, filled concurrently by the
+// workers.
+class ChecksumManifest
+{
+    struct Entry
+    {
+        std::string path;
+        uint64_t size;
+        uint64_t hash;
+        uint64_t annotation_hash;
+    };
+
+    std::mutex m_mutex;
+    std::vector<Entry> m_entries;
+
+  public:
+    void add(std::string path, uint64_t size, uint64_t hash,
+             uint64_t annotation_hash)
+    {
+        std::lock_guard lock{m_mutex};
+        m_entries.push_back(
+            {std::move(path), size, hash, annotation_hash});
+    }
+
+    // Writes "path,size,xxh3,annotation_xxh3" lines sorted by path, the
+    // hashes as 16 hex digits.
+    void write(const std::filesystem::path &file)
+    {
+        std::lock_guard lock{m_mutex};
+        std::sort(m_entries.begin(), m_entries.end(),
+                  [](const Entry &a, const Entry &b)
+                  { return a.path < b.path; });
+
+        std::ofstream out(file);
+        out << "path,size,xxh3,annotation_xxh3\n";
+        char hex[40];
+        for (auto &&e : m_entries)
+        {
+            std::snprintf(hex, sizeof(hex), ",%016llx,%016llx\n",
+                          (unsigned long long)e.hash,
+                          (unsigned long long)e.annotation_hash);
+            out << e.path << ',' << e.size << hex;
+        }
+        if (!out)
+            throw std::runtime_error("Cannot write " + file.string());
+    }
+};
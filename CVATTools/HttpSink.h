@@ -0,0 +1,289 @@
+// HttpSink.h : PUTs encoded masks to an S3-compatible object store over
+// plain HTTP/1.1.
+//
+// Connections are kept alive and reused. At most `max_connections` requests
+// are in flight, further writers block until a connection is free. Because
+// writes happen in the workers, a stalled store stalls rendering instead of
+// queueing masks in memory. Failed requests are retried with exponential
+// backoff on a fresh connection.
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "MaskSink.h"
+#include "Metrics.h"
+#include "Socket.h"
+
+class HttpSink : public MaskSink
+{
+    std::string m_host;
+    std::string m_port;
+    std::string m_path_prefix;
+    unsigned m_max_connections;
+    unsigned m_retries;
+    int m_timeout_seconds = 30;
+
+    std::mutex m_mutex;
+    std::condition_variable m_connection_free;
+    std::vector<Socket> m_idle;
+    unsigned m_in_use = 0;
+
+    struct Response
+    {
+        int status = 0;
+        bool keep_alive = false;
+    };
+
+    // Blocks until fewer than m_max_connections requests are in flight.
+    // Returns an idle connection or an invalid socket if a new one is needed.
+    Socket acquire()
+    {
+        std::unique_lock lock{m_mutex};
+        m_connection_free.wait(lock,
+                               [&] { return m_in_use < m_max_connections; });
+        ++m_in_use;
+        metrics().http_requests_in_flight.add(1);
+        if (m_idle.empty())
+            return {};
+        Socket s = std::move(m_idle.back());
+        m_idle.pop_back();
+        return s;
+    }
+
+    void give_back(Socket s, bool keep_alive)
+    {
+        {
+            std::lock_guard lock{m_mutex};
+            --m_in_use;
+            metrics().http_requests_in_flight.add(-1);
+            if (keep_alive && s.valid())
+                m_idle.push_back(std::move(s));
+        }
+        m_connection_free.notify_one();
+    }
+
+    static std::string url_encode(const std::string &path)
+    {
+        static constexpr char hex[] = "0123456789ABCDEF";
+        std::string result;
+        for (unsigned char c : path)
+        {
+            if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' ||
+                c == '~')
+            {
+                result += (char)c;
+            }
+            else
+            {
+                result += '%';
+                result += hex[c >> 4];
+                result += hex[c & 15];
+            }
+        }
+        return result;
+    }
+
+    // PNG masks, or the raw .bin files of the bitfield and packed modes.
+    static std::string_view content_type(std::string_view key) noexcept
+    {
+        return key.ends_with(".png") ? "image/png"
+                                     : "application/octet-stream";
+    }
+
+    static std::string lower(std::string s)
+    {
+        for (auto &c : s)
+            c = (char)tolower((unsigned char)c);
+        return s;
+    }
+
+    // Reads the response to a PUT, the body is read and dropped. Returns
+    // std::nullopt on connection errors.
+    static std::optional<Response> read_response(Socket &s)
+    {
+        std::string buffer;
+        char chunk[4096];
+        size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+        {
+            const auto n = s.receive(chunk, sizeof(chunk));
+            if (n <= 0)
+                return std::nullopt;
+            buffer.append(chunk, (size_t)n);
+        }
+
+        Response response;
+        const std::string headers = lower(buffer.substr(0, header_end + 2));
+        // "http/1.1 200 ok"
+        const auto space = headers.find(' ');
+        if (space == std::string::npos)
+            return std::nullopt;
+        response.status = atoi(headers.c_str() + space + 1);
+        response.keep_alive =
+            headers.compare(0, 8, "http/1.1") == 0 &&
+            headers.find("\r\nconnection: close\r\n") == std::string::npos;
+
+        std::string body = buffer.substr(header_end + 4);
+        auto read_until = [&](size_t size)
+        {
+            while (body.size() < size)
+            {
+                const auto n = s.receive(chunk, sizeof(chunk));
+                if (n <= 0)
+                    return false;
+                body.append(chunk, (size_t)n);
+            }
+            return true;
+        };
+
+        const auto length = headers.find("\r\ncontent-length:");
+        if (length != std::string::npos)
+        {
+            const size_t size =
+                strtoull(headers.c_str() + length + 17, nullptr, 10);
+            if (!read_until(size))
+                return std::nullopt;
+        }
+        else if (headers.find("\r\ntransfer-encoding: chunked") !=
+                 std::string::npos)
+        {
+            // chunk sizes are followed by CRLF, the last chunk has size 0
+            size_t pos = 0;
+            for (;;)
+            {
+                size_t line_end;
+                while ((line_end = body.find("\r\n", pos)) ==
+                       std::string::npos)
+                {
+                    if (!read_until(body.size() + 1))
+                        return std::nullopt;
+                }
+                const size_t size =
+                    strtoull(body.c_str() + pos, nullptr, 16);
+                pos = line_end + 2 + size + 2;
+                if (!read_until(pos))
+                    return std::nullopt;
+                if (size == 0)
+                    break;
+            }
+        }
+        else
+        {
+            // no framing, the server closes the connection after the body
+            response.keep_alive = false;
+        }
+        return response;
+    }
+
+  public:
+    // `url` is http://host[:port][/prefix]
+    HttpSink(const std::string &url, unsigned max_connections,
+             unsigned retries = 5)
+        : m_max_connections{std::max(max_connections, 1u)},
+          m_retries{retries}
+    {
+        constexpr std::string_view scheme = "http://";
+        if (url.compare(0, scheme.size(), scheme) != 0)
+        {
+            throw std::runtime_error("Only http:// URLs are supported: " +
+                                     url);
+        }
+        const auto rest = url.substr(scheme.size());
+        const auto slash = rest.find('/');
+        const auto authority = rest.substr(0, slash);
+        m_path_prefix =
+            slash == std::string::npos ? std::string() : rest.substr(slash);
+        if (m_path_prefix.empty() || m_path_prefix.back() != '/')
+            m_path_prefix += '/';
+
+        const auto colon = authority.rfind(':');
+        if (colon != std::string::npos &&
+            authority.find(']', colon) == std::string::npos)
+        {
+            m_host = authority.substr(0, colon);
+            m_port = authority.substr(colon + 1);
+        }
+        else
+        {
+            m_host = authority;
+            m_port = "80";
+        }
+        if (m_host.size() > 2 && m_host.front() == '[')
+            m_host = m_host.substr(1, m_host.size() - 2);
+    }
+
+    void write(const std::string &key,
+               const std::vector<unsigned char> &data) override
+    {
+        const std::string request_head =
+            "PUT " + url_encode(m_path_prefix + key) +
+            " HTTP/1.1\r\n"
+            "Host: " +
+            m_host + ":" + m_port +
+            "\r\n"
+            "Content-Type: " +
+            std::string(content_type(key)) +
+            "\r\n"
+            "Content-Length: " +
+            std::to_string(data.size()) + "\r\n\r\n";
+
+        std::string last_error;
+        for (unsigned attempt = 0; attempt <= m_retries; ++attempt)
+        {
+            if (attempt > 0)
+            {
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(100 << (attempt - 1)));
+            }
+
+            Socket s = acquire();
+            if (!s.valid())
+                s = Socket::connect(m_host, m_port, m_timeout_seconds);
+            if (!s.valid())
+            {
+                last_error = "cannot connect to " + m_host + ":" + m_port;
+                give_back(std::move(s), false);
+                continue;
+            }
+
+            std::optional<Response> response;
+            if (s.send_all(request_head.data(), request_head.size()) &&
+                s.send_all((const char *)data.data(), data.size()))
+            {
+                response = read_response(s);
+            }
+            if (!response)
+            {
+                last_error = "connection lost";
+                give_back(std::move(s), false);
+                continue;
+            }
+
+            give_back(std::move(s), response->keep_alive);
+            if (response->status >= 200 && response->status < 300)
+                return;
+            last_error = "HTTP status " + std::to_string(response->status);
+            // client errors will not go away by retrying
+            if (response->status >= 400 && response->status < 500 &&
+                response->status != 408 && response->status != 429)
+            {
+                break;
+            }
+        }
+        throw std::runtime_error("PUT " + m_path_prefix + key +
+                                 " failed: " + last_error);
+    }
+};
@@ -0,0 +1,225 @@
+// HugePages.h : 2 MB pages for large buffers.
+//
+// A 40 megapixel mask spans ten thousand 4 KB pages, walking it with many
+// labels thrashes the TLB. When enabled, large allocations come from the
+// hugetlb pool if one is configured, and otherwise from mappings aligned
+// to 2 MB and advised as transparent huge pages, which the kernel backs
+// with huge pages whenever THP is not disabled. Small allocations and
+// systems without huge pages use the regular heap.
+//
+// Users are the chunks of DocumentArena, the upstream of ScratchArena and,
+// through HugePageMatAllocator, cv::Mat of 32 MB and more.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+
+#include <opencv2/core.hpp>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace huge_pages
+{
+constexpr size_t page_size = size_t(2) << 20;
+
+inline std::atomic<bool> &enabled_flag() noexcept
+{
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+inline bool enabled() noexcept
+{
+    return enabled_flag().load(std::memory_order_relaxed);
+}
+
+// Set once at startup, before the first allocation.
+inline void enable(bool on) noexcept { enabled_flag() = on; }
+
+// Whether an allocation of `size` bytes goes to huge pages.
+inline bool eligible(size_t size) noexcept
+{
+#ifdef __linux__
+    return enabled() && size >= page_size;
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+inline size_t rounded(size_t size) noexcept
+{
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// `size` bytes on 2 MB pages, for eligible sizes only, nullptr if the
+// system has no memory left. Free with deallocate() and the same size.
+inline void *allocate(size_t size) noexcept
+{
+#ifdef __linux__
+    size = rounded(size);
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+
+    // no hugetlb pool, map with slack to cut out an aligned range for THP
+    const size_t mapped = size + page_size;
+    p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    const auto begin = (uintptr_t)p;
+    const auto aligned =
+        (begin + page_size - 1) & ~(uintptr_t)(page_size - 1);
+    if (aligned > begin)
+        munmap(p, aligned - begin);
+    if (aligned + size < begin + mapped)
+        munmap((void *)(aligned + size), begin + mapped - aligned - size);
+    madvise((void *)aligned, size, MADV_HUGEPAGE);
+    return (void *)aligned;
+#else
+    (void)size;
+    return nullptr;
+#endif
+}
+
+inline void deallocate(void *p, size_t size) noexcept
+{
+#ifdef __linux__
+    if (p != nullptr)
+        munmap(p, rounded(size));
+#else
+    (void)p;
+    (void)size;
+#endif
+}
+
+// Upstream resource, eligible requests go to huge pages and the rest to
+// the default resource.
+class Resource : public std::pmr::memory_resource
+{
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (eligible(bytes) && alignment <= page_size)
+        {
+            if (void *p = huge_pages::allocate(bytes))
+                return p;
+            throw std::bad_alloc();
+        }
+        return std::pmr::get_default_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        if (eligible(bytes) && alignment <= page_size)
+            huge_pages::deallocate(p, bytes);
+        else
+            std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+  public:
+    static Resource *instance()
+    {
+        static Resource resource;
+        return &resource;
+    }
+};
+} // namespace huge_pages
+
+// cv::Mat allocator putting large matrices on huge pages, otherwise the
+// same as OpenCV's default allocator. Installed with
+// cv::Mat::setDefaultAllocator, it must outlive all matrices.
+class HugePageMatAllocator : public cv::MatAllocator
+{
+    // Masks live for one label, so every huge page matrix is a fresh
+    // mapping to fault in. Below this size malloc reuses its freed blocks,
+    // which is faster. From it on, glibc maps and unmaps every block
+    // itself, so huge pages only save page faults.
+    static constexpr size_t min_size = size_t(32) << 20;
+
+    static bool eligible(size_t size) noexcept
+    {
+        return size >= min_size && huge_pages::eligible(size);
+    }
+
+  public:
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data0,
+                           size_t *step, cv::AccessFlag,
+                           cv::UMatUsageFlags) const override
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i)
+        {
+            if (step)
+            {
+                if (data0 && step[i] != CV_AUTOSTEP)
+                {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                }
+                else
+                {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        uchar *data = (uchar *)data0;
+        if (data == nullptr)
+        {
+            data = eligible(total) ? (uchar *)huge_pages::allocate(total)
+                                   : (uchar *)cv::fastMalloc(total);
+            if (data == nullptr)
+                throw std::bad_alloc();
+        }
+        auto u = new cv::UMatData(this);
+        u->data = u->origdata = data;
+        u->size = total;
+        if (data0)
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, cv::AccessFlag,
+                  cv::UMatUsageFlags) const override
+    {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData *u) const override
+    {
+        if (u == nullptr)
+            return;
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+        {
+            // eligible() is the same as at allocation, the flag is only
+            // set before the first matrix
+            if (eligible(u->size))
+                huge_pages::deallocate(u->origdata, u->size);
+            else
+                cv::fastFree(u->origdata);
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+
+    static HugePageMatAllocator *instance()
+    {
+        static HugePageMatAllocator allocator;
+        return &allocator;
+    }
+};
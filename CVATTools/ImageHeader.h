@@ -0,0 +1,99 @@
+// ImageHeader.h : image dimensions from the PNG or JPEG header, without
+// decoding the image.
+//
+// PNG keeps them in the IHDR chunk right after the signature. JPEG keeps
+// them in the start of frame segment, reached by skipping the segments in
+// front of it, which are usually only a few kilobytes of metadata.
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string_view>
+
+struct ImageSize
+{
+    uint32_t width;
+    uint32_t height;
+};
+
+namespace image_header_detail
+{
+inline uint32_t big_endian(const unsigned char *p, int bytes)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < bytes; ++i)
+        result = (result << 8) | p[i];
+    return result;
+}
+
+inline std::optional<ImageSize> png_size(std::istream &in)
+{
+    // signature (8), IHDR length (4), "IHDR" (4), width (4), height (4)
+    unsigned char header[24];
+    if (!in.read((char *)header, sizeof(header)) ||
+        std::string_view((const char *)header + 12, 4) != "IHDR")
+    {
+        return std::nullopt;
+    }
+    return ImageSize{big_endian(header + 16, 4), big_endian(header + 20, 4)};
+}
+
+inline std::optional<ImageSize> jpeg_size(std::istream &in)
+{
+    in.seekg(2);
+    for (;;)
+    {
+        int c = in.get();
+        if (c != 0xFF)
+            return std::nullopt;
+        // markers may be preceded by any number of fill bytes
+        while ((c = in.get()) == 0xFF)
+        {
+        }
+        if (c == EOF || c == 0xD9 || c == 0xDA)
+            return std::nullopt;
+        // stand-alone markers without a length
+        if (c == 0x01 || (c >= 0xD0 && c <= 0xD8))
+            continue;
+
+        unsigned char length_bytes[2];
+        if (!in.read((char *)length_bytes, 2))
+            return std::nullopt;
+        const uint32_t length = big_endian(length_bytes, 2);
+        if (length < 2)
+            return std::nullopt;
+
+        // SOF0 - SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC)
+        {
+            // precision (1), height (2), width (2)
+            unsigned char frame[5];
+            if (!in.read((char *)frame, sizeof(frame)))
+                return std::nullopt;
+            return ImageSize{big_endian(frame + 3, 2),
+                             big_endian(frame + 1, 2)};
+        }
+        in.seekg(length - 2, std::ios::cur);
+    }
+}
+} // namespace image_header_detail
+
+// Size of a PNG or JPEG file, std::nullopt if it cannot be read or is in
+// another format. EXIF orientation is not applied.
+inline std::optional<ImageSize>
+read_image_size(const std::filesystem::path &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    unsigned char magic[2];
+    if (!in.read((char *)magic, 2))
+        return std::nullopt;
+    in.seekg(0);
+    if (magic[0] == 0x89 && magic[1] == 'P')
+        return image_header_detail::png_size(in);
+    if (magic[0] == 0xFF && magic[1] == 0xD8)
+        return image_header_detail::jpeg_size(in);
+    return std::nullopt;
+}
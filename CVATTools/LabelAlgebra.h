@@ -0,0 +1,295 @@
+// LabelAlgebra.h : masks derived from the labels with set operations, like
+// "vehicle=car|truck|bus" or "car_body=car&~wheel".
+//
+// An expression is compiled once into a small stack program over the
+// labels it references. Per image, every referenced label is rendered once
+// into a bit-packed mask and the program combines them 64 pixels per word.
+// The loops are plain word-wise AND, OR and AND NOT over contiguous
+// arrays, which the compiler turns into SIMD instructions.
+//
+// Grammar, from the lowest to the highest precedence:
+//
+//   expression := term ('|' term)*
+//   term       := factor ('&' factor)*
+//   factor     := '~' factor | '(' expression ')' | label
+//
+// A label is everything up to the next operator or parenthesis, without
+// surrounding white space, so label names may contain spaces.
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "SpanMask.h"
+
+class LabelExpression
+{
+    enum class Op : uint8_t
+    {
+        push, // operand `label`
+        bit_or,
+        bit_and,
+        bit_and_not,
+        bit_not
+    };
+    struct Instruction
+    {
+        Op op;
+        uint32_t label;
+    };
+
+    std::string m_name;
+    // distinct label names, in order of their first use
+    std::vector<std::string> m_labels;
+    std::vector<Instruction> m_program;
+
+    // Recursive descent over `m_text`, emitting postfix instructions.
+    class Parser
+    {
+        LabelExpression &m_expression;
+        std::string_view m_text;
+        size_t m_pos = 0;
+
+        [[noreturn]] void fail(const std::string &what) const
+        {
+            throw std::runtime_error("Invalid label expression \"" +
+                                     std::string(m_text) + "\": " + what);
+        }
+
+        char peek()
+        {
+            while (m_pos < m_text.size() &&
+                   (m_text[m_pos] == ' ' || m_text[m_pos] == '\t'))
+                ++m_pos;
+            return m_pos < m_text.size() ? m_text[m_pos] : '\0';
+        }
+
+        void emit(Op op, uint32_t label = 0)
+        {
+            m_expression.m_program.push_back({op, label});
+        }
+
+        void factor()
+        {
+            const char c = peek();
+            if (c == '~')
+            {
+                ++m_pos;
+                factor();
+                emit(Op::bit_not);
+                return;
+            }
+            if (c == '(')
+            {
+                ++m_pos;
+                expression();
+                if (peek() != ')')
+                    fail("missing )");
+                ++m_pos;
+                return;
+            }
+
+            const size_t begin = m_pos;
+            while (m_pos < m_text.size() &&
+                   std::string_view("|&~()").find(m_text[m_pos]) ==
+                       std::string_view::npos)
+                ++m_pos;
+            std::string_view label = m_text.substr(begin, m_pos - begin);
+            while (!label.empty() &&
+                   (label.back() == ' ' || label.back() == '\t'))
+                label.remove_suffix(1);
+            if (label.empty())
+                fail("label expected at position " + std::to_string(begin));
+
+            auto &labels = m_expression.m_labels;
+            auto it = std::find(labels.begin(), labels.end(), label);
+            if (it == labels.end())
+                it = labels.emplace(labels.end(), label);
+            emit(Op::push, (uint32_t)(it - labels.begin()));
+        }
+
+        void term()
+        {
+            factor();
+            while (peek() == '&')
+            {
+                ++m_pos;
+                factor();
+                // a & ~b in one pass instead of two
+                auto &program = m_expression.m_program;
+                if (program.back().op == Op::bit_not)
+                {
+                    program.pop_back();
+                    emit(Op::bit_and_not);
+                }
+                else
+                    emit(Op::bit_and);
+            }
+        }
+
+        void expression()
+        {
+            term();
+            while (peek() == '|')
+            {
+                ++m_pos;
+                term();
+                emit(Op::bit_or);
+            }
+        }
+
+      public:
+        Parser(LabelExpression &expression, std::string_view text)
+            : m_expression{expression}, m_text{text}
+        {
+        }
+
+        void parse()
+        {
+            expression();
+            if (peek() != '\0')
+                fail("unexpected '" + std::string(1, m_text[m_pos]) + "'");
+        }
+    };
+
+  public:
+    // Parses "name=expression".
+    static LabelExpression parse(std::string_view definition)
+    {
+        const size_t equals = definition.find('=');
+        std::string_view name = definition.substr(0, equals);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+            name.remove_suffix(1);
+        if (equals == std::string_view::npos || name.empty())
+        {
+            throw std::runtime_error("Label expression \"" +
+                                     std::string(definition) +
+                                     "\" is not name=expression");
+        }
+        LabelExpression result;
+        result.m_name = std::string(name);
+        Parser{result, definition.substr(equals + 1)}.parse();
+        return result;
+    }
+
+    // Directory the derived masks are written to.
+    const std::string &name() const noexcept { return m_name; }
+
+    // Labels the expression references, evaluate() takes their masks in
+    // this order.
+    const std::vector<std::string> &labels() const noexcept
+    {
+        return m_labels;
+    }
+
+    // Combines the packed masks of labels() of a `width` x `height` image,
+    // rows of (width + 63) / 64 words as render_packed() writes them. Bits
+    // past the width are left clear.
+    std::vector<uint64_t> evaluate(std::span<const uint64_t *const> masks,
+                                   size_t width, size_t height) const
+    {
+        const size_t words_per_row = (width + 63) / 64;
+        const size_t words = words_per_row * height;
+
+        std::vector<std::vector<uint64_t>> stack;
+        for (auto &&instruction : m_program)
+        {
+            if (instruction.op == Op::push)
+            {
+                const uint64_t *mask = masks[instruction.label];
+                stack.emplace_back(mask, mask + words);
+                continue;
+            }
+            uint64_t *a = nullptr;
+            const uint64_t *b = nullptr;
+            if (instruction.op == Op::bit_not)
+                a = stack.back().data();
+            else
+            {
+                a = stack[stack.size() - 2].data();
+                b = stack.back().data();
+            }
+            switch (instruction.op)
+            {
+            case Op::bit_or:
+                for (size_t i = 0; i < words; ++i)
+                    a[i] |= b[i];
+                break;
+            case Op::bit_and:
+                for (size_t i = 0; i < words; ++i)
+                    a[i] &= b[i];
+                break;
+            case Op::bit_and_not:
+                for (size_t i = 0; i < words; ++i)
+                    a[i] &= ~b[i];
+                break;
+            case Op::bit_not:
+                for (size_t i = 0; i < words; ++i)
+                    a[i] = ~a[i];
+                break;
+            case Op::push:
+                break;
+            }
+            if (instruction.op != Op::bit_not)
+                stack.pop_back();
+        }
+
+        std::vector<uint64_t> result = std::move(stack.back());
+        // ~ also set the padding at the end of every row
+        if (width % 64 != 0)
+        {
+            const uint64_t last_mask = ~uint64_t(0) >> (64 - width % 64);
+            for (size_t y = 0; y < height; ++y)
+                result[(y + 1) * words_per_row - 1] &= last_mask;
+        }
+        return result;
+    }
+};
+
+// Spans of a bit-packed mask, the inverse of paint_bits().
+inline SpanMask unpack_spans(std::span<const uint64_t> words, int width,
+                             int height)
+{
+    SpanMask result(width, height);
+    const size_t words_per_row = ((size_t)width + 63) / 64;
+    for (int y = 0; y < height; ++y)
+    {
+        const uint64_t *row = words.data() + (size_t)y * words_per_row;
+        // start of the open span, -1 if there is none
+        int x0 = -1;
+        for (size_t w = 0; w < words_per_row; ++w)
+        {
+            const uint64_t bits = row[w];
+            if (bits == (x0 < 0 ? 0 : ~uint64_t(0)))
+                continue;
+            const int base = (int)(w * 64);
+            int b = 0;
+            while (b < 64)
+            {
+                // next set bit to open a span, or next clear bit to close it
+                const uint64_t rest = (x0 < 0 ? bits : ~bits) >> b;
+                if (rest == 0)
+                    break;
+                b += std::countr_zero(rest);
+                if (x0 < 0)
+                    x0 = base + b;
+                else
+                {
+                    result.add_span(y, x0, base + b);
+                    x0 = -1;
+                }
+            }
+        }
+        if (x0 >= 0)
+            result.add_span(y, x0, width);
+    }
+    result.finalize();
+    return result;
+}
@@ -0,0 +1,79 @@
+// MaskSink.h : destination of encoded masks.
+//
+// Workers call write() synchronously, so a slow sink stalls the worker and
+// the number of masks in flight never exceeds the number of workers.
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class MaskSink
+{
+  public:
+    virtual ~MaskSink() = default;
+
+    // Called with the distinct directories of the keys, like "car" and
+    // "car/cam1", before the first write() into them. Usually called once
+    // with all of them, streamed input adds the directories of new image
+    // subdirectories while workers are writing.
+    virtual void prepare(const std::vector<std::string> &directories) {}
+
+    // Stores `data` under `key`, a relative path like "car/0001.png".
+    // Called concurrently from all workers.
+    virtual void write(const std::string &key,
+                       const std::vector<unsigned char> &data) = 0;
+};
+
+class DirectorySink : public MaskSink
+{
+    std::filesystem::path m_directory;
+
+  public:
+    explicit DirectorySink(std::filesystem::path directory)
+        : m_directory{std::move(directory)}
+    {
+    }
+
+    // Creates the whole tree up front, so write() never touches anything
+    // but the file itself.
+    void prepare(const std::vector<std::string> &directories) override
+    {
+        for (auto &&d : directories)
+            std::filesystem::create_directories(m_directory / d);
+    }
+
+    void write(const std::string &key,
+               const std::vector<unsigned char> &data) override
+    {
+        const auto path = m_directory / key;
+        std::ofstream out(path, std::ios::binary);
+        out.write((const char *)data.data(), (std::streamsize)data.size());
+        if (!out)
+        {
+            throw std::runtime_error("Cannot write " + path.string());
+        }
+    }
+};
+
+// Discards the masks and only counts them and their bytes.
+class CountingSink : public MaskSink
+{
+    std::atomic<size_t> m_files{0};
+    std::atomic<size_t> m_bytes{0};
+
+  public:
+    void write(const std::string &,
+               const std::vector<unsigned char> &data) override
+    {
+        ++m_files;
+        m_bytes += data.size();
+    }
+
+    size_t files() const noexcept { return m_files; }
+    size_t bytes() const noexcept { return m_bytes; }
+};
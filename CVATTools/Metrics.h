@@ -0,0 +1,305 @@
+// Metrics.h : counters, gauges and latency histograms in the Prometheus
+// text format.
+//
+// Every update is a relaxed atomic operation, so workers never take a lock
+// to record anything. The text is produced on demand, either for a local
+// HTTP /metrics endpoint or for a textfile that node_exporter's textfile
+// collector picks up. Both are optional, without them the metrics are
+// still counted but never read.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "Socket.h"
+
+class Counter
+{
+    std::atomic<uint64_t> m_value{0};
+
+  public:
+    void add(uint64_t n = 1) noexcept
+    {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const noexcept
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+class Gauge
+{
+    std::atomic<int64_t> m_value{0};
+
+  public:
+    void add(int64_t n) noexcept
+    {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+    void set(int64_t n) noexcept
+    {
+        m_value.store(n, std::memory_order_relaxed);
+    }
+    int64_t value() const noexcept
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+// Latency histogram with fixed buckets from 0.5 ms to 10 s.
+class Histogram
+{
+    static constexpr std::array<double, 14> bounds{
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+        0.1,    0.25,  0.5,    1.0,   2.5,  5.0,   10.0};
+
+    // per bucket, not cumulative, the last one is +Inf
+    std::array<std::atomic<uint64_t>, bounds.size() + 1> m_buckets{};
+    std::atomic<uint64_t> m_sum_us{0};
+
+  public:
+    void observe_us(int64_t us) noexcept
+    {
+        const double seconds = (double)us / 1e6;
+        size_t b = 0;
+        while (b < bounds.size() && seconds > bounds[b])
+            ++b;
+        m_buckets[b].fetch_add(1, std::memory_order_relaxed);
+        m_sum_us.fetch_add((uint64_t)std::max<int64_t>(us, 0),
+                           std::memory_order_relaxed);
+    }
+
+    void write(std::ostream &out, std::string_view name,
+               std::string_view help) const
+    {
+        out << "# HELP " << name << ' ' << help << '\n';
+        out << "# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < m_buckets.size(); ++b)
+        {
+            cumulative += m_buckets[b].load(std::memory_order_relaxed);
+            out << name << "_bucket{le=\"";
+            if (b < bounds.size())
+                out << bounds[b];
+            else
+                out << "+Inf";
+            out << "\"} " << cumulative << '\n';
+        }
+        out << name << "_sum " << (double)m_sum_us.load() / 1e6 << '\n';
+        out << name << "_count " << cumulative << '\n';
+    }
+};
+
+struct Metrics
+{
+    Counter images_rendered;
+    Counter masks_written;
+    Counter bytes_written;
+    // label tasks of split images, parsing the shared image or reusing it
+    Counter shared_image_parses;
+    Counter shared_image_reuses;
+
+    Gauge tasks_pending;
+    Gauge stream_queue_depth;
+    Gauge http_requests_in_flight;
+
+    Histogram render_seconds;
+    Histogram encode_seconds;
+    Histogram write_seconds;
+
+    // Whether a consumer is configured, latencies are only measured then.
+    std::atomic<bool> enabled{false};
+
+    std::string text() const
+    {
+        std::ostringstream out;
+        out.precision(12);
+        auto counter = [&](std::string_view name, std::string_view help,
+                           const Counter &c)
+        {
+            out << "# HELP " << name << ' ' << help << '\n'
+                << "# TYPE " << name << " counter\n"
+                << name << ' ' << c.value() << '\n';
+        };
+        auto gauge = [&](std::string_view name, std::string_view help,
+                         const Gauge &g)
+        {
+            out << "# HELP " << name << ' ' << help << '\n'
+                << "# TYPE " << name << " gauge\n"
+                << name << ' ' << g.value() << '\n';
+        };
+
+        counter("cvattools_images_rendered_total",
+                "Images with all masks written.", images_rendered);
+        counter("cvattools_masks_written_total",
+                "Masks or per-image files handed to the output.",
+                masks_written);
+        counter("cvattools_bytes_written_total",
+                "Encoded bytes handed to the output.", bytes_written);
+        counter("cvattools_shared_image_parses_total",
+                "Split images whose shapes were decoded for their label "
+                "tasks.",
+                shared_image_parses);
+        counter("cvattools_shared_image_reuses_total",
+                "Label tasks rendering from an already decoded image.",
+                shared_image_reuses);
+        gauge("cvattools_tasks_pending", "Render tasks not finished yet.",
+              tasks_pending);
+        gauge("cvattools_stream_queue_depth",
+              "Images read from stdin waiting for a worker.",
+              stream_queue_depth);
+        gauge("cvattools_http_requests_in_flight",
+              "Uploads to the object store in progress.",
+              http_requests_in_flight);
+        render_seconds.write(out, "cvattools_render_seconds",
+                             "Time to rasterize one mask.");
+        encode_seconds.write(out, "cvattools_encode_seconds",
+                             "Time to encode one mask.");
+        write_seconds.write(out, "cvattools_write_seconds",
+                            "Time to hand one mask to the output.");
+        return out.str();
+    }
+};
+
+inline Metrics &metrics()
+{
+    static Metrics instance;
+    return instance;
+}
+
+// Rewrites `path` with the current metrics every `interval` and once more
+// when it goes away. The text goes to a temporary file next to it that is
+// renamed over it, so the collector never reads half a file.
+class MetricsTextfile
+{
+    std::filesystem::path m_path;
+    std::chrono::seconds m_interval;
+    std::mutex m_mutex;
+    std::condition_variable m_stop_requested;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    void write() const
+    {
+        auto temporary = m_path;
+        temporary += ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            out << metrics().text();
+            if (!out)
+                return;
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, m_path, error);
+    }
+
+  public:
+    MetricsTextfile(std::filesystem::path path, std::chrono::seconds interval)
+        : m_path{std::move(path)}, m_interval{interval}
+    {
+        metrics().enabled = true;
+        m_thread = std::thread(
+            [this]
+            {
+                std::unique_lock lock{m_mutex};
+                do
+                {
+                    write();
+                } while (!m_stop_requested.wait_for(lock, m_interval,
+                                                    [&] { return m_stop; }));
+            });
+    }
+    MetricsTextfile(const MetricsTextfile &) = delete;
+    MetricsTextfile &operator=(const MetricsTextfile &) = delete;
+
+    ~MetricsTextfile()
+    {
+        {
+            std::lock_guard lock{m_mutex};
+            m_stop = true;
+        }
+        m_stop_requested.notify_all();
+        m_thread.join();
+        write();
+    }
+};
+
+// Serves the metrics on http://127.0.0.1:`port`/metrics until it goes away.
+// Requests are answered one at a time on a single thread.
+class MetricsServer
+{
+    Socket m_listener;
+    std::atomic<bool> m_stop{false};
+    std::thread m_thread;
+
+    static void answer(Socket &client)
+    {
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos &&
+               request.size() < 8192)
+        {
+            const auto received = client.receive(buffer, sizeof(buffer));
+            if (received <= 0)
+                return;
+            request.append(buffer, (size_t)received);
+        }
+
+        const bool found = request.starts_with("GET /metrics ") ||
+                           request.starts_with("GET /metrics?");
+        const std::string body =
+            found ? metrics().text() : std::string("not found\n");
+        const std::string head =
+            std::string(found ? "HTTP/1.1 200 OK\r\n"
+                              : "HTTP/1.1 404 Not Found\r\n") +
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " +
+            std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        client.send_all(head.data(), head.size()) &&
+            client.send_all(body.data(), body.size());
+    }
+
+  public:
+    explicit MetricsServer(uint16_t port)
+        : m_listener{Socket::listen_local(port)}
+    {
+        if (!m_listener.valid())
+        {
+            throw std::runtime_error("Cannot listen on 127.0.0.1:" +
+                                     std::to_string(port));
+        }
+        metrics().enabled = true;
+        m_thread = std::thread(
+            [this]
+            {
+                while (!m_stop)
+                {
+                    Socket client = m_listener.accept(200, 5);
+                    if (client.valid())
+                        answer(client);
+                }
+            });
+    }
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    ~MetricsServer()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
+};
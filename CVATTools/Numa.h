@@ -0,0 +1,178 @@
+// Numa.h : worker placement on multi-socket machines.
+//
+// The nodes and their CPUs come from /sys/devices/system/node. Workers are
+// spread over the nodes in blocks and pinned to the CPUs of their node
+// before they touch any memory, so their scratch arenas, the heap arenas
+// malloc hands them and the masks they render are first touched, and
+// therefore placed, on the local node. Where the topology is unknown
+// (other systems, no sysfs) there is a single node and nothing is pinned.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+class NumaTopology
+{
+    // CPUs of every node with at least one online CPU
+    std::vector<std::vector<int>> m_nodes;
+
+    // Parses a sysfs cpulist like "0-7,16-23".
+    static std::vector<int> parse_cpulist(const std::string &list)
+    {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            const std::string range = list.substr(pos, end - pos);
+            const size_t dash = range.find('-');
+            try
+            {
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = dash == std::string::npos
+                                     ? first
+                                     : std::stoi(range.substr(dash + 1));
+                for (int c = first; c <= last; ++c)
+                    cpus.push_back(c);
+            }
+            catch (const std::exception &)
+            {
+                // trailing newline or malformed entry
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+
+    NumaTopology()
+    {
+#ifdef __linux__
+        std::error_code error;
+        for (size_t n = 0;; ++n)
+        {
+            const std::filesystem::path node =
+                "/sys/devices/system/node/node" + std::to_string(n);
+            if (!std::filesystem::exists(node, error))
+                break;
+            std::ifstream in(node / "cpulist");
+            std::string list;
+            std::getline(in, list);
+            auto cpus = parse_cpulist(list);
+            if (!cpus.empty())
+                m_nodes.push_back(std::move(cpus));
+        }
+#endif
+        if (m_nodes.empty())
+            m_nodes.emplace_back();
+    }
+
+  public:
+    static const NumaTopology &system()
+    {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    size_t node_count() const noexcept { return m_nodes.size(); }
+
+    // Node of worker `worker` of `workers`, node n gets the n-th block.
+    size_t node_of(unsigned worker, unsigned workers) const noexcept
+    {
+        return (size_t)worker * m_nodes.size() / workers;
+    }
+
+    // Pins the calling thread to the CPUs of `node`, false if that is not
+    // possible here.
+    bool pin(size_t node) const
+    {
+#ifdef __linux__
+        if (node >= m_nodes.size() || m_nodes[node].empty())
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : m_nodes[node])
+        {
+            if (c < CPU_SETSIZE)
+                CPU_SET(c, &set);
+        }
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        (void)node;
+        return false;
+#endif
+    }
+};
+
+// Runs f(i) for every i in [0, count) on `workers` threads like
+// parallel_for, with the workers pinned to their NUMA node. [0, count) is
+// split into one contiguous block per node, sized by its number of
+// workers, so neighbouring items stay on one node. A node that is done
+// with its block helps the others.
+template <typename F>
+void numa_parallel_for(size_t count, F &&f, unsigned workers = 0)
+{
+    const NumaTopology &topology = NumaTopology::system();
+    if (workers == 0)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    const size_t nodes = topology.node_count();
+
+    struct Block
+    {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+    };
+    const auto blocks = std::make_unique<Block[]>(nodes);
+    for (size_t n = 0; n < nodes; ++n)
+    {
+        // workers [first, last) are on node n
+        unsigned first = 0;
+        while (first < workers && topology.node_of(first, workers) < n)
+            ++first;
+        unsigned last = first;
+        while (last < workers && topology.node_of(last, workers) == n)
+            ++last;
+        blocks[n].next = count * first / workers;
+        blocks[n].end = count * last / workers;
+    }
+
+    std::vector<std::future<void>> futures;
+    for (unsigned w = 0; w < workers; ++w)
+    {
+        futures.push_back(std::async(
+            std::launch::async,
+            [&, w]()
+            {
+                const size_t node = topology.node_of(w, workers);
+                topology.pin(node);
+                for (size_t k = 0; k < nodes; ++k)
+                {
+                    Block &block = blocks[(node + k) % nodes];
+                    for (size_t i = block.next++; i < block.end;
+                         i = block.next++)
+                    {
+                        f(i);
+                    }
+                }
+            }));
+    }
+
+    for (auto &&fu : futures)
+    {
+        fu.get();
+    }
+}
@@ -0,0 +1,281 @@
+// PerfCounters.h : hardware performance counters per pipeline stage and
+// thread, from Linux perf_event_open.
+//
+// Every thread that records anything opens its own counter group for
+// cycles, instructions, cache misses and branch misses, counting only that
+// thread in user space. The stages read the group at their boundaries and
+// add the difference to the thread's totals, which outlive the thread for
+// the report at the end. A low IPC together with many cache misses per
+// instruction points at a memory-bound stage, a high IPC at a compute-bound
+// one.
+//
+// With more events than hardware counters the kernel multiplexes the group
+// and it only counts part of the time. The counts are then scaled up by the
+// time the group was enabled over the time it ran, and the report shows
+// that share.
+//
+// Elsewhere, or when the kernel refuses (perf_event_paranoid, containers
+// without a PMU), nothing is counted and the report says why.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum class PerfStage
+{
+    load,
+    render,
+    encode,
+    write
+};
+
+struct PerfValues
+{
+    static constexpr size_t count = 4;
+    // cycles, instructions, cache misses, branch misses
+    std::array<uint64_t, count> values{};
+    // nanoseconds the group was enabled and actually counting
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+
+    PerfValues operator-(const PerfValues &other) const noexcept
+    {
+        PerfValues result;
+        for (size_t i = 0; i < count; ++i)
+            result.values[i] = values[i] - other.values[i];
+        result.time_enabled = time_enabled - other.time_enabled;
+        result.time_running = time_running - other.time_running;
+        return result;
+    }
+    PerfValues &operator+=(const PerfValues &other) noexcept
+    {
+        for (size_t i = 0; i < count; ++i)
+            values[i] += other.values[i];
+        time_enabled += other.time_enabled;
+        time_running += other.time_running;
+        return *this;
+    }
+
+    // The counts extrapolated to the whole time the group was enabled.
+    PerfValues scaled() const noexcept
+    {
+        PerfValues result = *this;
+        if (time_running > 0 && time_running < time_enabled)
+        {
+            const double scale = (double)time_enabled / time_running;
+            for (size_t i = 0; i < count; ++i)
+                result.values[i] = (uint64_t)((double)values[i] * scale);
+        }
+        return result;
+    }
+};
+
+class PerfCounters
+{
+    static constexpr size_t stage_count = 4;
+    static constexpr const char *stage_names[stage_count] = {
+        "load", "render", "encode", "write"};
+
+    // Counter group and totals of one thread.
+    struct Thread
+    {
+        int fds[PerfValues::count] = {-1, -1, -1, -1};
+        bool open = false;
+        std::array<PerfValues, stage_count> totals{};
+
+        ~Thread()
+        {
+            for (int fd : fds)
+            {
+#ifdef __linux__
+                if (fd >= 0)
+                    close(fd);
+#else
+                (void)fd;
+#endif
+            }
+        }
+    };
+
+    std::atomic<bool> m_enabled{false};
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<Thread>> m_threads;
+    std::string m_error;
+
+    static PerfCounters &instance()
+    {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    // Opens the group of the calling thread, records the reason on failure.
+    void open(Thread &thread)
+    {
+#ifdef __linux__
+        static constexpr uint64_t configs[PerfValues::count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (size_t i = 0; i < PerfValues::count; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP |
+                               PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            const int leader = i == 0 ? -1 : thread.fds[0];
+            thread.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                                         leader, 0);
+            if (thread.fds[i] < 0)
+            {
+                std::lock_guard lock{m_mutex};
+                if (m_error.empty())
+                    m_error = std::string("perf_event_open: ") +
+                              std::strerror(errno);
+                return;
+            }
+        }
+        thread.open = true;
+#else
+        (void)thread;
+        std::lock_guard lock{m_mutex};
+        m_error = "perf counters need Linux";
+#endif
+    }
+
+    Thread &local()
+    {
+        thread_local std::shared_ptr<Thread> thread = [this]
+        {
+            auto t = std::make_shared<Thread>();
+            open(*t);
+            std::lock_guard lock{m_mutex};
+            m_threads.push_back(t);
+            return t;
+        }();
+        return *thread;
+    }
+
+  public:
+    // Call once at startup, before any thread records.
+    static void enable() { instance().m_enabled = true; }
+
+    static bool enabled() noexcept
+    {
+        return instance().m_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Counts of the calling thread so far, zero if not enabled.
+    static PerfValues now()
+    {
+        PerfValues result;
+        if (!enabled())
+            return result;
+        Thread &thread = instance().local();
+#ifdef __linux__
+        if (!thread.open)
+            return result;
+        // count, time enabled, time running, values
+        uint64_t buffer[3 + PerfValues::count];
+        if (read(thread.fds[0], buffer, sizeof(buffer)) ==
+                (ssize_t)sizeof(buffer) &&
+            buffer[0] == PerfValues::count)
+        {
+            result.time_enabled = buffer[1];
+            result.time_running = buffer[2];
+            for (size_t i = 0; i < PerfValues::count; ++i)
+                result.values[i] = buffer[3 + i];
+        }
+#else
+        (void)thread;
+#endif
+        return result;
+    }
+
+    // Adds the counts since `start`, taken with now() on this thread, and
+    // returns the current ones as the start of the next stage.
+    static PerfValues add(PerfStage stage, const PerfValues &start)
+    {
+        if (!enabled())
+            return start;
+        const PerfValues end = now();
+        instance().local().totals[(size_t)stage] += (end - start).scaled();
+        return end;
+    }
+
+    static void report(std::ostream &out)
+    {
+        PerfCounters &self = instance();
+        if (!self.enabled())
+            return;
+        std::lock_guard lock{self.m_mutex};
+        if (!self.m_error.empty())
+        {
+            out << "perf counters unavailable: " << self.m_error << '\n';
+            return;
+        }
+
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        auto row = [&](const std::string &name, const PerfValues &v)
+        {
+            const auto [cycles, instructions, cache, branch] = v.values;
+            if (cycles == 0 && instructions == 0)
+                return;
+            const double kilo = instructions > 0 ? instructions / 1000.0 : 1;
+            const double running =
+                v.time_enabled > 0
+                    ? 100.0 * (double)v.time_running / v.time_enabled
+                    : 100.0;
+            out << std::left << std::setw(18) << name << std::right
+                << std::setw(16) << cycles << std::setw(16) << instructions
+                << std::setw(7) << std::fixed << std::setprecision(2)
+                << (cycles > 0 ? (double)instructions / cycles : 0.0)
+                << std::setw(14) << cache << std::setw(10)
+                << cache / kilo << std::setw(14) << branch << std::setw(10)
+                << branch / kilo << std::setw(9) << std::setprecision(1)
+                << running << '\n';
+        };
+        out << std::left << std::setw(18) << "perf counters" << std::right
+            << std::setw(16) << "cycles" << std::setw(16) << "instructions"
+            << std::setw(7) << "IPC" << std::setw(14) << "cache miss"
+            << std::setw(10) << "/1k ins" << std::setw(14) << "branch miss"
+            << std::setw(10) << "/1k ins" << std::setw(9) << "ran %"
+            << '\n';
+        for (size_t s = 0; s < stage_count; ++s)
+        {
+            PerfValues total;
+            for (size_t t = 0; t < self.m_threads.size(); ++t)
+            {
+                const auto &v = self.m_threads[t]->totals[s];
+                row(std::string(stage_names[s]) + " thread " +
+                        std::to_string(t),
+                    v);
+                total += v;
+            }
+            row(std::string(stage_names[s]) + " total", total);
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+};
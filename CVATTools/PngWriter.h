@@ -0,0 +1,130 @@
+// PngWriter.h : encodes a SpanMask as 8 bit grayscale PNG without ever
+// materializing the dense mask.
+//
+// Every scanline uses the "Up" filter. For a binary mask the filtered byte is
+// only non-zero where the current and the previous row differ, so it can be
+// generated from the two span lists and zlib sees long runs of zeros.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+#include "SpanMask.h"
+
+class PngWriter
+{
+    std::vector<unsigned char> &m_out;
+
+    void put_u32(uint32_t v)
+    {
+        m_out.push_back((unsigned char)(v >> 24));
+        m_out.push_back((unsigned char)(v >> 16));
+        m_out.push_back((unsigned char)(v >> 8));
+        m_out.push_back((unsigned char)v);
+    }
+
+    void chunk(const char type[4], const unsigned char *data, size_t size)
+    {
+        put_u32((uint32_t)size);
+        const size_t type_pos = m_out.size();
+        m_out.insert(m_out.end(), type, type + 4);
+        m_out.insert(m_out.end(), data, data + size);
+        put_u32((uint32_t)crc32(0, m_out.data() + type_pos,
+                                (uInt)(size + 4)));
+    }
+
+  public:
+    explicit PngWriter(std::vector<unsigned char> &out) : m_out{out} {}
+
+    void write(const SpanMask &mask, unsigned char value = 255,
+               int compression_level = 1)
+    {
+        static constexpr unsigned char signature[] = {0x89, 'P',  'N',  'G',
+                                                      '\r', '\n', 0x1a, '\n'};
+        m_out.insert(m_out.end(), std::begin(signature), std::end(signature));
+
+        const auto w = (uint32_t)mask.width();
+        const auto h = (uint32_t)mask.height();
+        const unsigned char ihdr[13] = {
+            (unsigned char)(w >> 24), (unsigned char)(w >> 16),
+            (unsigned char)(w >> 8),  (unsigned char)w,
+            (unsigned char)(h >> 24), (unsigned char)(h >> 16),
+            (unsigned char)(h >> 8),  (unsigned char)h,
+            8, // bit depth
+            0, // grayscale
+            0, // deflate
+            0, // adaptive filtering
+            0, // no interlace
+        };
+        chunk("IHDR", ihdr, sizeof(ihdr));
+
+        z_stream zs{};
+        // same settings OpenCV's PNG encoder uses by default
+        if (deflateInit2(&zs, compression_level, Z_DEFLATED, 15, 8, Z_RLE) !=
+            Z_OK)
+        {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+
+        // filter type byte followed by the filtered row
+        std::vector<unsigned char> scanline((size_t)w + 1);
+        std::vector<unsigned char> compressed(1 << 16);
+        const unsigned char removed = (unsigned char)(0 - value);
+
+        auto flush = [&](int mode)
+        {
+            int ret;
+            do
+            {
+                zs.next_out = compressed.data();
+                zs.avail_out = (uInt)compressed.size();
+                ret = deflate(&zs, mode);
+                const size_t produced = compressed.size() - zs.avail_out;
+                if (produced > 0)
+                    chunk("IDAT", compressed.data(), produced);
+            } while (zs.avail_out == 0 ||
+                     (mode == Z_FINISH && ret != Z_STREAM_END));
+        };
+
+        for (int y = 0; y < (int)h; ++y)
+        {
+            scanline[0] = 2; // Up
+            std::memset(scanline.data() + 1, 0, w);
+            if (y > 0)
+            {
+                auto [b, e] = mask.row(y - 1);
+                for (; b != e; ++b)
+                    std::memset(scanline.data() + 1 + b->x0, removed,
+                                (size_t)(b->x1 - b->x0));
+            }
+            auto [b, e] = mask.row(y);
+            for (; b != e; ++b)
+            {
+                unsigned char *p = scanline.data() + 1;
+                for (int x = b->x0; x < b->x1; ++x)
+                    p[x] = p[x] ? 0 : value;
+            }
+
+            zs.next_in = scanline.data();
+            zs.avail_in = (uInt)scanline.size();
+            flush(Z_NO_FLUSH);
+        }
+        flush(Z_FINISH);
+        deflateEnd(&zs);
+
+        chunk("IEND", nullptr, 0);
+    }
+};
+
+inline std::vector<unsigned char> encode_png(const SpanMask &mask,
+                                             unsigned char value = 255)
+{
+    std::vector<unsigned char> png;
+    PngWriter{png}.write(mask, value);
+    return png;
+}
@@ -0,0 +1,107 @@
+// Raster.h : kernels writing finalized spans into pixel buffers.
+//
+// Every kernel is a template on the pixel type and the combine operation,
+// so each output mode gets its own inlined loop without per-pixel branches.
+//
+//   binary     uint8_t   Set  255
+//   class8/16  uint8_t / uint16_t, class id of the topmost shape (max z)
+//   bitfield   uint32_t  Or   1 << label
+//   packed     one bit per pixel, 64 pixels per uint64_t word
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "SpanMask.h"
+
+// Row-major pixel buffer, `stride` is in pixels.
+template <typename Pixel> struct Raster
+{
+    Pixel *data;
+    size_t stride;
+
+    Pixel *row(int y) const noexcept { return data + (size_t)y * stride; }
+};
+
+// Combine operations, the new value of a covered pixel.
+struct SetPixel
+{
+    template <typename Pixel>
+    static Pixel apply(Pixel, Pixel value) noexcept
+    {
+        return value;
+    }
+};
+
+struct OrPixel
+{
+    template <typename Pixel>
+    static Pixel apply(Pixel old, Pixel value) noexcept
+    {
+        return (Pixel)(old | value);
+    }
+};
+
+struct MaxPixel
+{
+    template <typename Pixel>
+    static Pixel apply(Pixel old, Pixel value) noexcept
+    {
+        return std::max(old, value);
+    }
+};
+
+// Combines `value` into every pixel covered by `mask`.
+template <typename Combine, typename Pixel>
+void paint(const SpanMask &mask, Raster<Pixel> out, Pixel value) noexcept
+{
+    for (auto &&s : mask.spans())
+    {
+        Pixel *row = out.row(s.y);
+        for (int x = s.x0; x < s.x1; ++x)
+            row[x] = Combine::apply(row[x], value);
+    }
+}
+
+// Writes `value` where `z` is at least the depth already stored, so the
+// shape with the highest z order wins and equal z orders keep the later
+// shape. `depth` starts out at the minimum of int32_t.
+template <typename Pixel>
+void paint_max_z(const SpanMask &mask, Raster<Pixel> out,
+                 Raster<int32_t> depth, Pixel value, int32_t z) noexcept
+{
+    for (auto &&s : mask.spans())
+    {
+        Pixel *row = out.row(s.y);
+        int32_t *depth_row = depth.row(s.y);
+        for (int x = s.x0; x < s.x1; ++x)
+        {
+            const bool above = z >= depth_row[x];
+            row[x] = above ? value : row[x];
+            depth_row[x] = above ? z : depth_row[x];
+        }
+    }
+}
+
+// Sets the bits of all covered pixels, bit x % 64 of word x / 64 of a row.
+inline void paint_bits(const SpanMask &mask, Raster<uint64_t> out) noexcept
+{
+    for (auto &&s : mask.spans())
+    {
+        uint64_t *row = out.row(s.y);
+        const int first = s.x0 >> 6;
+        const int last = (s.x1 - 1) >> 6;
+        const uint64_t first_mask = ~uint64_t(0) << (s.x0 & 63);
+        const uint64_t last_mask = ~uint64_t(0) >> (63 - ((s.x1 - 1) & 63));
+        if (first == last)
+        {
+            row[first] |= first_mask & last_mask;
+            continue;
+        }
+        row[first] |= first_mask;
+        std::fill(row + first + 1, row + last, ~uint64_t(0));
+        row[last] |= last_mask;
+    }
+}
@@ -0,0 +1,189 @@
+// Shape.h : decoded annotation shape, independent of whether it comes from
+// the XML document or from an on-disk index, and the code drawing it.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "SpanMask.h"
+
+enum class ShapeType : uint8_t
+{
+    unknown,
+    polygon,
+    box,
+    points,
+    polyline,
+    ellipse,
+};
+
+inline ShapeType shape_type(const char *xml_name) noexcept
+{
+    if (strcmp(xml_name, "polygon") == 0)
+        return ShapeType::polygon;
+    if (strcmp(xml_name, "box") == 0)
+        return ShapeType::box;
+    if (strcmp(xml_name, "points") == 0)
+        return ShapeType::points;
+    if (strcmp(xml_name, "polyline") == 0)
+        return ShapeType::polyline;
+    if (strcmp(xml_name, "ellipse") == 0)
+        return ShapeType::ellipse;
+    return ShapeType::unknown;
+}
+
+// Decoded points of a shape, usually backed by a ScratchArena.
+using PointBuffer = std::pmr::vector<cv::Point>;
+
+struct ShapeData
+{
+    ShapeType type = ShapeType::unknown;
+    // polygon, points and polyline
+    std::span<const cv::Point> points;
+    // box: xtl, ytl, xbr, ybr
+    // ellipse: cx, cy, rx, ry
+    int values[4] = {};
+    // ellipse rotation in degrees
+    float rotation = 0.f;
+    // CVAT z_order, shapes with a higher one are drawn on top
+    int z_order = 0;
+    // whether a polygon passes SpanMask::is_monotone, unset until the span
+    // renderer or the index writer needs it
+    std::optional<bool> monotone;
+};
+
+// Covered area in pixels, without rasterizing. Overlaps between shapes are
+// not accounted for.
+inline double shape_area(const ShapeData &shape)
+{
+    const int *v = shape.values;
+    const auto &pts = shape.points;
+
+    switch (shape.type)
+    {
+    case ShapeType::polygon:
+    {
+        double twice_area = 0.0;
+        for (size_t i = 0; i < pts.size(); ++i)
+        {
+            const auto &a = pts[i];
+            const auto &b = pts[(i + 1) % pts.size()];
+            twice_area += (double)a.x * b.y - (double)b.x * a.y;
+        }
+        return std::abs(twice_area) / 2.0;
+    }
+    case ShapeType::box:
+        return std::max(v[2] - v[0], 0) * (double)std::max(v[3] - v[1], 0);
+    case ShapeType::points:
+        return (double)pts.size();
+    case ShapeType::polyline:
+    {
+        // one pixel per step of an 8-connected line
+        double length = pts.empty() ? 0.0 : 1.0;
+        for (size_t i = 1; i < pts.size(); ++i)
+        {
+            length += std::max(std::abs(pts[i].x - pts[i - 1].x),
+                               std::abs(pts[i].y - pts[i - 1].y));
+        }
+        return length;
+    }
+    case ShapeType::ellipse:
+        return 3.14159265358979323846 * v[2] * v[3];
+    case ShapeType::unknown:
+        break;
+    }
+    return 0.0;
+}
+
+// The shape in an image scaled by `scale`, the points are kept alive by
+// `storage`.
+inline ShapeData scaled_shape(const ShapeData &shape, double scale,
+                              std::vector<cv::Point> &storage)
+{
+    ShapeData result = shape;
+    storage.clear();
+    for (auto &&p : shape.points)
+    {
+        storage.emplace_back((int)std::lround(p.x * scale),
+                             (int)std::lround(p.y * scale));
+    }
+    result.points = storage;
+    for (int &v : result.values)
+        v = (int)std::lround(v * scale);
+    return result;
+}
+
+inline void draw_shape(cv::Mat &in_out, const ShapeData &shape)
+{
+    const cv::Point *pts = shape.points.data();
+    const int npts = (int)shape.points.size();
+    const int *v = shape.values;
+
+    switch (shape.type)
+    {
+    case ShapeType::polygon:
+        if (npts > 0)
+            cv::fillPoly(in_out, &pts, &npts, 1, (unsigned char)255);
+        break;
+    case ShapeType::box:
+        cv::rectangle(in_out, cv::Rect{v[0], v[1], v[2] - v[0], v[3] - v[1]},
+                      255, cv::FILLED);
+        break;
+    case ShapeType::points:
+        for (auto &&p : shape.points)
+        {
+            cv::circle(in_out, p, 0, 255, cv::FILLED);
+        }
+        break;
+    case ShapeType::polyline:
+        if (npts > 0)
+            cv::polylines(in_out, &pts, &npts, 1, false, 255);
+        break;
+    case ShapeType::ellipse:
+        cv::ellipse(in_out, cv::Point(v[0], v[1]), cv::Size(v[2], v[3]),
+                    shape.rotation, 0, 360, 255, cv::FILLED);
+        break;
+    case ShapeType::unknown:
+        break;
+    }
+}
+
+inline void draw_shape(SpanMask &in_out, const ShapeData &shape)
+{
+    const int *v = shape.values;
+
+    switch (shape.type)
+    {
+    case ShapeType::polygon:
+        if (shape.monotone ? *shape.monotone
+                           : SpanMask::is_monotone(shape.points))
+            in_out.fill_monotone_polygon(shape.points);
+        else
+            in_out.fill_polygon(shape.points);
+        break;
+    case ShapeType::box:
+        in_out.fill_rect(v[0], v[1], v[2] - v[0], v[3] - v[1]);
+        break;
+    case ShapeType::points:
+        in_out.draw_points(shape.points);
+        break;
+    case ShapeType::polyline:
+        in_out.draw_polyline(shape.points);
+        break;
+    case ShapeType::ellipse:
+        in_out.fill_ellipse(cv::Point(v[0], v[1]), cv::Size(v[2], v[3]),
+                            shape.rotation);
+        break;
+    case ShapeType::unknown:
+        break;
+    }
+}
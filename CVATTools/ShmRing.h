@@ -0,0 +1,212 @@
+// ShmRing.h : producer side of the shared memory mask ring described in
+// cvattools_shm.h.
+//
+// Workers claim a slot, render the mask directly into its payload and
+// publish it. When all slots are taken, acquire() waits for the consumer,
+// so a slow trainer throttles rendering.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "cvattools_shm.h"
+
+static_assert(sizeof(cvat_shm_header) == 64, "header is one cache line");
+static_assert(sizeof(cvat_shm_slot) % 64 == 0,
+              "payloads start cache line aligned");
+
+class ShmRing
+{
+    std::string m_name;
+    cvat_shm_header *m_header = nullptr;
+    size_t m_size = 0;
+
+    template <typename T> static std::atomic_ref<T> atomic(T &value)
+    {
+        return std::atomic_ref<T>(value);
+    }
+
+    // Waits with a growing sleep, the other side may be a different process.
+    template <typename Ready> static void wait_until(Ready &&ready)
+    {
+        auto delay = std::chrono::microseconds(1);
+        while (!ready())
+        {
+            std::this_thread::sleep_for(delay);
+            delay = std::min(delay * 2, std::chrono::microseconds(1000));
+        }
+    }
+
+  public:
+    class Slot
+    {
+        ShmRing *m_ring;
+        cvat_shm_slot *m_slot;
+        uint64_t m_sequence;
+        bool m_published = false;
+
+      public:
+        Slot(ShmRing *ring, cvat_shm_slot *slot, uint64_t sequence)
+            : m_ring{ring}, m_slot{slot}, m_sequence{sequence}
+        {
+        }
+        Slot(const Slot &) = delete;
+        Slot &operator=(const Slot &) = delete;
+
+        // A slot that is dropped unpublished, e.g. on an exception, is
+        // handed to the consumer as an empty 0x0 mask so it does not stall.
+        ~Slot()
+        {
+            if (!m_published)
+            {
+                m_slot->width = 0;
+                m_slot->height = 0;
+                publish();
+            }
+        }
+
+        // Sets the mask metadata. width * height must not exceed
+        // payload_capacity().
+        void describe(uint32_t image_index, std::string_view image,
+                      uint32_t label_index, std::string_view label,
+                      uint32_t width, uint32_t height)
+        {
+            if ((uint64_t)width * height > m_ring->payload_capacity())
+            {
+                throw std::runtime_error("Mask of " + std::string(image) +
+                                         " does not fit into a ring slot");
+            }
+            m_slot->width = width;
+            m_slot->height = height;
+            m_slot->image_index = image_index;
+            m_slot->label_index = label_index;
+            copy_name(m_slot->image, image);
+            copy_name(m_slot->label, label);
+        }
+
+        unsigned char *data() noexcept { return cvat_shm_payload(m_slot); }
+
+        void publish() noexcept
+        {
+            m_published = true;
+            atomic(m_slot->sequence)
+                .store(m_sequence + 1, std::memory_order_release);
+        }
+
+      private:
+        template <size_t N>
+        static void copy_name(char (&target)[N], std::string_view name)
+        {
+            const size_t n = std::min(name.size(), N - 1);
+            memcpy(target, name.data(), n);
+            target[n] = 0;
+        }
+    };
+
+    // Creates the segment "/<name>", replacing a stale one of the same name.
+    ShmRing(const std::string &name, uint32_t slot_count,
+            uint64_t payload_capacity, uint64_t image_count,
+            uint32_t label_count)
+        : m_name{"/" + name}
+    {
+#ifdef _WIN32
+        throw std::runtime_error("Shared memory output needs POSIX shm_open");
+#else
+        slot_count = std::max(slot_count, 1u);
+        // page aligned slots keep payloads of neighbouring slots apart
+        const uint64_t slot_size =
+            (sizeof(cvat_shm_slot) + payload_capacity + 4095) & ~uint64_t(4095);
+        m_size = sizeof(cvat_shm_header) + slot_count * slot_size;
+
+        shm_unlink(m_name.c_str());
+        const int fd =
+            shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Cannot create shared memory " + m_name);
+        if (ftruncate(fd, (off_t)m_size) != 0)
+        {
+            ::close(fd);
+            shm_unlink(m_name.c_str());
+            throw std::runtime_error("Cannot allocate shared memory " +
+                                     m_name);
+        }
+        void *data =
+            mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+        {
+            shm_unlink(m_name.c_str());
+            throw std::runtime_error("Cannot map shared memory " + m_name);
+        }
+
+        m_header = (cvat_shm_header *)data;
+        m_header->version = CVAT_SHM_VERSION;
+        m_header->slot_count = slot_count;
+        m_header->status = CVAT_SHM_RUNNING;
+        m_header->slot_size = slot_size;
+        m_header->payload_capacity = payload_capacity;
+        m_header->write_index = 0;
+        m_header->read_index = 0;
+        m_header->image_count = image_count;
+        m_header->label_count = label_count;
+        for (uint32_t i = 0; i < slot_count; ++i)
+            cvat_shm_slot_at(m_header, i)->sequence = i;
+        atomic(m_header->magic)
+            .store(CVAT_SHM_MAGIC, std::memory_order_release);
+#endif
+    }
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    // The segment is left in place, the consumer unlinks it.
+    ~ShmRing()
+    {
+#ifndef _WIN32
+        if (m_header != nullptr)
+            munmap(m_header, m_size);
+#endif
+    }
+
+    uint64_t payload_capacity() const noexcept
+    {
+        return m_header->payload_capacity;
+    }
+
+    // Claims the next slot, waits while the consumer is a full ring behind.
+    Slot acquire()
+    {
+        const uint64_t sequence = atomic(m_header->write_index)
+                                      .fetch_add(1, std::memory_order_relaxed);
+        cvat_shm_slot *slot = cvat_shm_slot_at(m_header, sequence);
+        wait_until(
+            [&]
+            {
+                return atomic(slot->sequence)
+                           .load(std::memory_order_acquire) == sequence;
+            });
+        return Slot(this, slot, sequence);
+    }
+
+    // Tells the consumer that no more masks follow.
+    void finish(bool success) noexcept
+    {
+        atomic(m_header->status)
+            .store(success ? CVAT_SHM_FINISHED : CVAT_SHM_FAILED,
+                   std::memory_order_release);
+    }
+};
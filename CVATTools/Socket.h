@@ -0,0 +1,199 @@
+// Socket.h : minimal RAII wrapper around a TCP socket, for HttpSink and the
+// metrics endpoint.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+class Socket
+{
+#ifdef _WIN32
+    using native_type = SOCKET;
+    static constexpr native_type invalid = INVALID_SOCKET;
+#else
+    using native_type = int;
+    static constexpr native_type invalid = -1;
+#endif
+    native_type m_socket = invalid;
+
+    static bool started()
+    {
+#ifdef _WIN32
+        static const bool wsa_started = []
+        {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        return wsa_started;
+#else
+        return true;
+#endif
+    }
+
+    void set_timeout(int timeout_seconds) noexcept
+    {
+#ifdef _WIN32
+        const DWORD timeout = timeout_seconds * 1000;
+#else
+        const timeval timeout{timeout_seconds, 0};
+#endif
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
+                   sizeof(timeout));
+        setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout,
+                   sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        const int one = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_NOSIGPIPE, (const char *)&one,
+                   sizeof(one));
+#endif
+    }
+
+  public:
+    Socket() = default;
+    explicit Socket(native_type s) : m_socket{s} {}
+    Socket(Socket &&other) noexcept : m_socket{other.m_socket}
+    {
+        other.m_socket = invalid;
+    }
+    Socket &operator=(Socket &&other) noexcept
+    {
+        std::swap(m_socket, other.m_socket);
+        return *this;
+    }
+    ~Socket() { close(); }
+
+    bool valid() const noexcept { return m_socket != invalid; }
+
+    void close() noexcept
+    {
+        if (!valid())
+            return;
+#ifdef _WIN32
+        closesocket(m_socket);
+#else
+        ::close(m_socket);
+#endif
+        m_socket = invalid;
+    }
+
+    static Socket connect(const std::string &host, const std::string &port,
+                          int timeout_seconds)
+    {
+        if (!started())
+            return {};
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+            return {};
+
+        Socket result;
+        for (addrinfo *a = addresses; a != nullptr; a = a->ai_next)
+        {
+            Socket s{::socket(a->ai_family, a->ai_socktype, a->ai_protocol)};
+            if (!s.valid())
+                continue;
+            if (::connect(s.m_socket, a->ai_addr, (int)a->ai_addrlen) == 0)
+            {
+                result = std::move(s);
+                break;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (!result.valid())
+            return result;
+
+        const int one = 1;
+        setsockopt(result.m_socket, IPPROTO_TCP, TCP_NODELAY,
+                   (const char *)&one, sizeof(one));
+        result.set_timeout(timeout_seconds);
+        return result;
+    }
+
+    // Socket listening on 127.0.0.1:`port`, invalid if it cannot be bound.
+    static Socket listen_local(uint16_t port)
+    {
+        if (!started())
+            return {};
+        Socket s{::socket(AF_INET, SOCK_STREAM, 0)};
+        if (!s.valid())
+            return s;
+        const int one = 1;
+        setsockopt(s.m_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&one,
+                   sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(s.m_socket, (const sockaddr *)&address, sizeof(address)) !=
+                0 ||
+            ::listen(s.m_socket, 16) != 0)
+        {
+            return {};
+        }
+        return s;
+    }
+
+    // Next connection of a listening socket, invalid if none arrives within
+    // `timeout_ms`.
+    Socket accept(int timeout_ms, int timeout_seconds)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(m_socket, &readable);
+        timeval wait{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        if (::select((int)m_socket + 1, &readable, nullptr, nullptr, &wait) <=
+            0)
+        {
+            return {};
+        }
+        Socket result{::accept(m_socket, nullptr, nullptr)};
+        if (result.valid())
+            result.set_timeout(timeout_seconds);
+        return result;
+    }
+
+    bool send_all(const char *data, size_t size) noexcept
+    {
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        while (size > 0)
+        {
+            const auto sent = ::send(m_socket, data, (int)size, flags);
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= (size_t)sent;
+        }
+        return true;
+    }
+
+    // Bytes received, 0 on a closed connection, negative on errors.
+    long long receive(char *data, size_t size) noexcept
+    {
+        return ::recv(m_socket, data, (int)size, 0);
+    }
+};
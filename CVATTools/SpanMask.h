@@ -0,0 +1,548 @@
+// SpanMask.h : run-length representation of a binary mask.
+//
+// Shapes are rasterized into horizontal spans instead of a dense cv::Mat.
+// After finalize() the spans are sorted by row and column and overlapping
+// spans of the same row are merged, which unions all shapes of a label.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+struct Span
+{
+    int y;
+    int x0; // first pixel
+    int x1; // one past the last pixel
+};
+
+class SpanMask
+{
+    int m_width;
+    int m_height;
+    std::vector<Span> m_spans;
+    // m_spans[m_row_begin[y] .. m_row_begin[y + 1]) belong to row y, only
+    // valid after finalize()
+    std::vector<size_t> m_row_begin;
+
+    void add_pixel(int x, int y) { add_span(y, x, x + 1); }
+
+    // Fixed-point coordinates of cv::ellipse, with 16 fractional bits.
+    static constexpr int xy_shift = 16;
+    static constexpr long long xy_one = 1LL << xy_shift;
+
+    struct FixedPoint
+    {
+        long long x;
+        long long y;
+    };
+
+    // Clips the line to a `width` x `height` area the way cv::clipLine does.
+    // The clipped end points change the error term, so this is needed to get
+    // the same pixels.
+    static bool clip_line(long long width, long long height, long long &x1,
+                          long long &y1, long long &x2, long long &y2)
+    {
+        const long long right = width - 1;
+        const long long bottom = height - 1;
+        auto code = [&](long long x, long long y)
+        { return (x < 0) + (x > right) * 2 + (y < 0) * 4 + (y > bottom) * 8; };
+        int c1 = code(x1, y1);
+        int c2 = code(x2, y2);
+        if ((c1 & c2) == 0 && (c1 | c2) != 0)
+        {
+            if (c1 & 12)
+            {
+                const long long e = c1 < 8 ? 0 : bottom;
+                x1 += (long long)((double)(e - y1) * (x2 - x1) / (y2 - y1));
+                y1 = e;
+                c1 = (x1 < 0) + (x1 > right) * 2;
+            }
+            if (c2 & 12)
+            {
+                const long long e = c2 < 8 ? 0 : bottom;
+                x2 += (long long)((double)(e - y2) * (x2 - x1) / (y2 - y1));
+                y2 = e;
+                c2 = (x2 < 0) + (x2 > right) * 2;
+            }
+            if ((c1 & c2) == 0 && (c1 | c2) != 0)
+            {
+                if (c1)
+                {
+                    const long long e = c1 == 1 ? 0 : right;
+                    y1 += (long long)((double)(e - x1) * (y2 - y1) / (x2 - x1));
+                    x1 = e;
+                    c1 = 0;
+                }
+                if (c2)
+                {
+                    const long long e = c2 == 1 ? 0 : right;
+                    y2 += (long long)((double)(e - x2) * (y2 - y1) / (x2 - x1));
+                    x2 = e;
+                    c2 = 0;
+                }
+            }
+        }
+        return (c1 | c2) == 0;
+    }
+
+    bool clip_line(cv::Point &a, cv::Point &b) const
+    {
+        long long x1 = a.x, y1 = a.y, x2 = b.x, y2 = b.y;
+        const bool visible = clip_line(m_width, m_height, x1, y1, x2, y2);
+        a = cv::Point((int)x1, (int)y1);
+        b = cv::Point((int)x2, (int)y2);
+        return visible;
+    }
+
+    // 8-connected line with the same error term as cv::line, the pixels are
+    // merged in finalize()
+    void add_line(cv::Point a, cv::Point b)
+    {
+        if (!clip_line(a, b))
+            return;
+        if (b.x < a.x)
+            std::swap(a, b);
+        const int dx = b.x - a.x;
+        const int sy = b.y < a.y ? -1 : 1;
+        const int dy = std::abs(b.y - a.y);
+        const bool steep = dy > dx;
+        const int major = steep ? dy : dx;
+        const int minor = steep ? dx : dy;
+
+        int err = major - 2 * minor;
+        for (int i = 0; i <= major; ++i)
+        {
+            add_pixel(a.x, a.y);
+            const bool minor_step = err < 0;
+            err += -2 * minor + (minor_step ? 2 * major : 0);
+            if (steep || minor_step)
+                a.y += sy;
+            if (!steep || minor_step)
+                a.x += 1;
+        }
+    }
+
+    // 8-connected line between fixed-point end points, as cv::ellipse draws
+    // the outline of a filled ellipse.
+    void add_line(FixedPoint a, FixedPoint b)
+    {
+        if (!clip_line((long long)m_width << xy_shift,
+                       (long long)m_height << xy_shift, a.x, a.y, b.x, b.y))
+            return;
+        constexpr long long half = xy_one >> 1;
+        long long dx = b.x - a.x;
+        long long dy = b.y - a.y;
+        const long long ax = std::abs(dx);
+        const long long ay = std::abs(dy);
+        // step along the major axis, starting at the smaller end
+        const bool steep = ax <= ay;
+        if (steep ? dy < 0 : dx < 0)
+        {
+            std::swap(a, b);
+            dx = -dx;
+            dy = -dy;
+        }
+        add_pixel((int)((b.x + half) >> xy_shift),
+                  (int)((b.y + half) >> xy_shift));
+        if (!steep)
+        {
+            const long long y_step = (dy << xy_shift) / (ax | 1);
+            long long count = (b.x - a.x) >> xy_shift;
+            long long x = (a.x + half) >> xy_shift;
+            long long y = a.y + half;
+            for (; count >= 0; --count, ++x, y += y_step)
+                add_pixel((int)x, (int)(y >> xy_shift));
+        }
+        else
+        {
+            const long long x_step = (dx << xy_shift) / (ay | 1);
+            long long count = (b.y - a.y) >> xy_shift;
+            long long x = a.x + half;
+            long long y = (a.y + half) >> xy_shift;
+            for (; count >= 0; --count, x += x_step, ++y)
+                add_pixel((int)(x >> xy_shift), (int)y);
+        }
+    }
+
+    // cv::fillConvexPoly of fixed-point vertices: two edges are walked down
+    // from the top vertex and the outline is added on top.
+    void fill_convex_polygon(std::span<const FixedPoint> pts)
+    {
+        const int n = (int)pts.size();
+        if (n == 0)
+            return;
+        constexpr long long half = xy_one >> 1;
+
+        int top = 0;
+        long long x_min = pts[0].x, x_max = pts[0].x;
+        long long y_min = pts[0].y, y_max = pts[0].y;
+        for (int i = 0; i < n; ++i)
+        {
+            if (pts[i].y < y_min)
+            {
+                y_min = pts[i].y;
+                top = i;
+            }
+            y_max = std::max(y_max, pts[i].y);
+            x_min = std::min(x_min, pts[i].x);
+            x_max = std::max(x_max, pts[i].x);
+            add_line(pts[(i + n - 1) % n], pts[i]);
+        }
+        x_min = (x_min + half) >> xy_shift;
+        x_max = (x_max + half) >> xy_shift;
+        y_min = (y_min + half) >> xy_shift;
+        y_max = (y_max + half) >> xy_shift;
+        if (n < 3 || x_max < 0 || y_max < 0 || x_min >= m_width ||
+            y_min >= m_height)
+            return;
+        y_max = std::min<long long>(y_max, m_height - 1);
+
+        struct Edge
+        {
+            int i;
+            int step;
+            long long x;
+            long long dx;
+            long long y_end; // row of the next vertex
+        };
+        Edge edges[2] = {{top, 1, -xy_one, 0, y_min},
+                         {top, n - 1, -xy_one, 0, y_min}};
+        // edges not walked yet, shared by both sides
+        int remaining = n;
+        for (long long y = y_min; y <= y_max; ++y)
+        {
+            for (Edge &e : edges)
+            {
+                if (y < e.y_end)
+                    continue;
+                int from = e.i;
+                int to = (from + e.step) % n;
+                while (remaining-- > 0)
+                {
+                    const long long y_to = (pts[to].y + half) >> xy_shift;
+                    if (y_to > y)
+                    {
+                        e.y_end = y_to;
+                        e.dx = ((pts[to].x - pts[from].x) * 2 + (y_to - y)) /
+                               (2 * (y_to - y));
+                        e.x = pts[from].x;
+                        e.i = to;
+                        break;
+                    }
+                    from = to;
+                    to = (to + e.step) % n;
+                }
+            }
+            if (remaining < 0)
+                break;
+            if (y >= 0)
+            {
+                const long long left = std::min(edges[0].x, edges[1].x);
+                const long long right = std::max(edges[0].x, edges[1].x);
+                add_span((int)y, (int)((left + half) >> xy_shift),
+                         (int)((right + half) >> xy_shift) + 1);
+            }
+            edges[0].x += edges[0].dx;
+            edges[1].x += edges[1].dx;
+        }
+    }
+
+  public:
+    SpanMask(int width, int height) : m_width{width}, m_height{height} {}
+
+    int width() const noexcept { return m_width; }
+    int height() const noexcept { return m_height; }
+    bool empty() const noexcept { return m_spans.empty(); }
+
+    // Drops all spans, keeping the memory for the next shape.
+    void clear() noexcept
+    {
+        m_spans.clear();
+        m_row_begin.clear();
+    }
+
+    // Adds [x0, x1) of row y, clipped to the mask.
+    void add_span(int y, int x0, int x1)
+    {
+        if (y < 0 || y >= m_height)
+            return;
+        x0 = std::max(x0, 0);
+        x1 = std::min(x1, m_width);
+        if (x0 >= x1)
+            return;
+        m_spans.push_back({y, x0, x1});
+    }
+
+    void fill_rect(int x, int y, int w, int h)
+    {
+        if (w <= 0 || h <= 0)
+            return;
+        const int y_end = std::min(y + h, m_height);
+        for (int row = std::max(y, 0); row < y_end; ++row)
+            add_span(row, x, x + w);
+    }
+
+    // Scanline fill with an active edge table. Pixel centers inside the
+    // polygon are filled and the outline is added on top, so boundary pixels
+    // are covered like cv::fillPoly does.
+    void fill_polygon(std::span<const cv::Point> pts)
+    {
+        if (pts.empty())
+            return;
+
+        struct Edge
+        {
+            int y_top;
+            int y_bottom; // exclusive
+            double x;     // x at y_top
+            double dxdy;
+        };
+        std::vector<Edge> edges;
+        edges.reserve(pts.size());
+        for (size_t i = 0; i < pts.size(); ++i)
+        {
+            cv::Point a = pts[i];
+            cv::Point b = pts[(i + 1) % pts.size()];
+            if (a.y == b.y)
+                continue;
+            if (a.y > b.y)
+                std::swap(a, b);
+            edges.push_back({a.y, b.y, double(a.x),
+                             double(b.x - a.x) / double(b.y - a.y)});
+        }
+        std::sort(edges.begin(), edges.end(),
+                  [](const Edge &l, const Edge &r) { return l.y_top < r.y_top; });
+
+        std::vector<const Edge *> active;
+        std::vector<double> xs;
+        size_t next_edge = 0;
+        const int y_first = edges.empty() ? 0 : std::max(edges.front().y_top, 0);
+        for (int y = y_first; y < m_height; ++y)
+        {
+            while (next_edge < edges.size() && edges[next_edge].y_top <= y)
+                active.push_back(&edges[next_edge++]);
+            std::erase_if(active,
+                          [y](const Edge *e) { return e->y_bottom <= y; });
+            if (active.empty())
+            {
+                if (next_edge == edges.size())
+                    break;
+                continue;
+            }
+
+            xs.clear();
+            for (const Edge *e : active)
+                xs.push_back(e->x + (y - e->y_top) * e->dxdy);
+            std::sort(xs.begin(), xs.end());
+            for (size_t i = 0; i + 1 < xs.size(); i += 2)
+            {
+                add_span(y, (int)std::ceil(xs[i]),
+                         (int)std::floor(xs[i + 1]) + 1);
+            }
+        }
+
+        for (size_t i = 0; i < pts.size(); ++i)
+            add_line(pts[i], pts[(i + 1) % pts.size()]);
+    }
+
+    // Whether every row crosses the outline at most twice, so that the
+    // outline goes down once and up once. True for all convex polygons.
+    static bool is_monotone(std::span<const cv::Point> pts) noexcept
+    {
+        if (pts.size() < 3)
+            return false;
+        int first = 0;
+        int last = 0;
+        int turns = 0;
+        for (size_t i = 0; i < pts.size(); ++i)
+        {
+            const int dy = pts[(i + 1) % pts.size()].y - pts[i].y;
+            if (dy == 0)
+                continue;
+            const int direction = dy > 0 ? 1 : -1;
+            if (first == 0)
+                first = direction;
+            else if (direction != last)
+                ++turns;
+            last = direction;
+        }
+        if (last != first)
+            ++turns;
+        return turns == 2;
+    }
+
+    // fill_polygon() for polygons passing is_monotone(), with the same
+    // pixels. Every row has exactly two active edges, so instead of an edge
+    // table one edge on either side is walked down from the top vertex.
+    void fill_monotone_polygon(std::span<const cv::Point> pts)
+    {
+        const size_t n = pts.size();
+        if (n == 0)
+            return;
+
+        // one chain of edges going down from the top vertex, the edges are
+        // the same as in fill_polygon()
+        struct Walker
+        {
+            std::span<const cv::Point> pts;
+            size_t step;
+            size_t i;
+            int y_top;
+            int y_bottom; // exclusive
+            double x;     // x at y_top
+            double dxdy;
+
+            // Moves to the edge crossing row y, false if the chain ends
+            // above it.
+            bool advance(int y)
+            {
+                for (size_t k = 0; y_bottom <= y; ++k)
+                {
+                    const cv::Point a = pts[i];
+                    i = (i + step) % pts.size();
+                    const cv::Point b = pts[i];
+                    if (b.y < a.y || k == pts.size())
+                        return false;
+                    y_top = a.y;
+                    y_bottom = b.y;
+                    x = double(a.x);
+                    dxdy = b.y > a.y ? double(b.x - a.x) / double(b.y - a.y)
+                                     : 0.0;
+                }
+                return true;
+            }
+
+            double x_at(int y) const { return x + (y - y_top) * dxdy; }
+        };
+
+        size_t top = 0;
+        int y_end = pts[0].y;
+        for (size_t i = 1; i < n; ++i)
+        {
+            if (pts[i].y < pts[top].y)
+                top = i;
+            y_end = std::max(y_end, pts[i].y);
+        }
+        const int y_top = pts[top].y;
+        Walker a{pts, 1, top, y_top, y_top, 0.0, 0.0};
+        Walker b{pts, n - 1, top, y_top, y_top, 0.0, 0.0};
+        y_end = std::min(y_end, m_height);
+        for (int y = std::max(y_top, 0); y < y_end; ++y)
+        {
+            if (!a.advance(y) || !b.advance(y))
+                break;
+            const double xa = a.x_at(y);
+            const double xb = b.x_at(y);
+            add_span(y, (int)std::ceil(std::min(xa, xb)),
+                     (int)std::floor(std::max(xa, xb)) + 1);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            add_line(pts[i], pts[(i + 1) % n]);
+    }
+
+    void draw_polyline(std::span<const cv::Point> pts)
+    {
+        if (pts.size() == 1)
+            add_pixel(pts[0].x, pts[0].y);
+        for (size_t i = 1; i < pts.size(); ++i)
+            add_line(pts[i - 1], pts[i]);
+    }
+
+    void draw_points(std::span<const cv::Point> pts)
+    {
+        for (auto &&p : pts)
+            add_pixel(p.x, p.y);
+    }
+
+    // The pixels of cv::ellipse(..., cv::FILLED): the outline with the
+    // angle rounded by cvRound, a step that grows with the size of the
+    // ellipse and vertices with 16 fractional bits, filled like
+    // cv::fillConvexPoly fills them.
+    void fill_ellipse(cv::Point center, cv::Size axes, double rotation)
+    {
+        const int width = std::abs(axes.width);
+        const int height = std::abs(axes.height);
+        const int size = std::max(width, height);
+        const int delta = size < 3 ? 90 : size < 10 ? 30 : size < 15 ? 18 : 5;
+        const FixedPoint fixed_center{(long long)center.x << xy_shift,
+                                      (long long)center.y << xy_shift};
+        std::vector<cv::Point2d> outline;
+        cv::ellipse2Poly(cv::Point2d((double)fixed_center.x,
+                                     (double)fixed_center.y),
+                         cv::Size2d((double)width * xy_one,
+                                    (double)height * xy_one),
+                         cvRound(rotation), 0, 360, delta, outline);
+
+        std::vector<FixedPoint> pts;
+        pts.reserve(outline.size());
+        for (auto &&p : outline)
+        {
+            // whole pixels and the fraction are rounded separately
+            FixedPoint q{(long long)cvRound(p.x / xy_one) << xy_shift,
+                         (long long)cvRound(p.y / xy_one) << xy_shift};
+            q.x += cvRound(p.x - (double)q.x);
+            q.y += cvRound(p.y - (double)q.y);
+            if (pts.empty() || q.x != pts.back().x || q.y != pts.back().y)
+                pts.push_back(q);
+        }
+        if (pts.size() == 1)
+            pts.assign(2, fixed_center);
+        fill_convex_polygon(pts);
+    }
+
+    // Sorts the spans and merges overlapping or touching spans per row.
+    void finalize()
+    {
+        std::sort(m_spans.begin(), m_spans.end(),
+                  [](const Span &l, const Span &r)
+                  { return l.y != r.y ? l.y < r.y : l.x0 < r.x0; });
+
+        size_t out = 0;
+        for (size_t i = 0; i < m_spans.size(); ++i)
+        {
+            if (out > 0 && m_spans[out - 1].y == m_spans[i].y &&
+                m_spans[out - 1].x1 >= m_spans[i].x0)
+            {
+                m_spans[out - 1].x1 = std::max(m_spans[out - 1].x1,
+                                               m_spans[i].x1);
+            }
+            else
+            {
+                m_spans[out++] = m_spans[i];
+            }
+        }
+        m_spans.resize(out);
+
+        m_row_begin.assign((size_t)m_height + 1, 0);
+        for (auto &&s : m_spans)
+            ++m_row_begin[(size_t)s.y + 1];
+        for (size_t y = 0; y < (size_t)m_height; ++y)
+            m_row_begin[y + 1] += m_row_begin[y];
+    }
+
+    // Number of set pixels, requires finalize().
+    size_t area() const noexcept
+    {
+        size_t result = 0;
+        for (auto &&s : m_spans)
+            result += (size_t)(s.x1 - s.x0);
+        return result;
+    }
+
+    // All spans, sorted by row and column after finalize().
+    std::span<const Span> spans() const noexcept { return m_spans; }
+
+    // Spans of row y, requires finalize().
+    std::pair<const Span *, const Span *> row(int y) const
+    {
+        const Span *base = m_spans.data();
+        return {base + m_row_begin[(size_t)y], base + m_row_begin[(size_t)y + 1]};
+    }
+};
@@ -0,0 +1,270 @@
+// cvattools_c.cpp : libcvattools, the C API declared in cvattools_c.h.
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AnnotationIndex.h"
+#include "CVATTools.h"
+#include "cvattools_c.h"
+
+struct cvat_task
+{
+    // either the XML document or the index is open
+    std::unique_ptr<CVATMaskGenerator> generator;
+    std::vector<Image> images;
+    std::unique_ptr<AnnotationIndex> index;
+
+    // zero terminated copies, index strings are not terminated
+    std::vector<std::string> image_names;
+    std::vector<std::string> label_names;
+    std::vector<std::string_view> labels;
+};
+
+namespace
+{
+thread_local std::string last_error;
+
+cvat_status fail(cvat_status status, std::string message)
+{
+    last_error = std::move(message);
+    return status;
+}
+
+// Runs f, turning exceptions into a status, f returns a cvat_status itself.
+template <typename F> cvat_status guarded(F &&f) noexcept
+{
+    try
+    {
+        last_error.clear();
+        return f();
+    }
+    catch (const std::bad_alloc &)
+    {
+        return fail(CVAT_ERROR_INTERNAL, "out of memory");
+    }
+    catch (const std::exception &e)
+    {
+        return fail(CVAT_ERROR_INTERNAL, e.what());
+    }
+    catch (...)
+    {
+        return fail(CVAT_ERROR_INTERNAL, "unknown error");
+    }
+}
+
+cvat_status render(const cvat_task &task, size_t image, size_t label,
+                   uint8_t *buffer, size_t stride)
+{
+    if (buffer == nullptr || image >= task.image_names.size() ||
+        label >= task.label_names.size())
+    {
+        return fail(CVAT_ERROR_ARGUMENT, "invalid image, label or buffer");
+    }
+
+    // the rasterizer of the command line tool without --spans
+    const WriteOptions options{};
+    auto draw = [&](const auto &img, const auto &label_key)
+    {
+        if (stride < img.width())
+        {
+            return fail(CVAT_ERROR_BUFFER,
+                        "stride is smaller than the width of " +
+                            task.image_names[image]);
+        }
+        ScratchArena::Scope scratch;
+        cv::Mat mask((int)img.height(), (int)img.width(), CV_8UC1, buffer,
+                     stride);
+        mask.setTo(0);
+        render_mask(img, label_key, options, mask);
+        return CVAT_OK;
+    };
+
+    if (task.index)
+        return draw(task.index->image(image), (uint32_t)label);
+    return draw(task.images[image], task.labels[label]);
+}
+} // namespace
+
+extern "C"
+{
+
+int cvat_api_version(void) { return CVAT_API_VERSION; }
+
+const char *cvat_last_error(void) { return last_error.c_str(); }
+
+cvat_status cvat_open(const char *path, cvat_task **task)
+{
+    return guarded(
+        [&]
+        {
+            if (path == nullptr || task == nullptr)
+                return fail(CVAT_ERROR_ARGUMENT, "path and task are required");
+            *task = nullptr;
+
+            auto result = std::make_unique<cvat_task>();
+            if (AnnotationIndex::is_index_file(path))
+            {
+                try
+                {
+                    result->index = std::make_unique<AnnotationIndex>(path);
+                }
+                catch (const std::exception &e)
+                {
+                    return fail(CVAT_ERROR_PARSE, e.what());
+                }
+                const auto &index = *result->index;
+                for (size_t i = 0; i < index.image_count(); ++i)
+                {
+                    result->image_names.emplace_back(
+                        index.image(i).filename());
+                }
+                for (auto &&l : index.labels())
+                    result->label_names.emplace_back(l);
+            }
+            else
+            {
+                pugi::xml_document doc;
+                const auto parsed = doc.load_file(path);
+                if (parsed.status == pugi::status_file_not_found ||
+                    parsed.status == pugi::status_io_error)
+                {
+                    return fail(CVAT_ERROR_IO,
+                                std::string("Cannot open ") + path);
+                }
+                if (!parsed)
+                {
+                    return fail(CVAT_ERROR_PARSE,
+                                std::string("Cannot parse ") + path + ": " +
+                                    parsed.description());
+                }
+                result->generator =
+                    std::make_unique<CVATMaskGenerator>(std::move(doc));
+                for (auto &&image : result->generator->images())
+                {
+                    result->images.push_back(image);
+                    result->image_names.emplace_back(image.filename());
+                }
+                result->labels = result->generator->labels();
+                for (auto &&l : result->labels)
+                    result->label_names.emplace_back(l);
+            }
+
+            *task = result.release();
+            return CVAT_OK;
+        });
+}
+
+void cvat_close(cvat_task *task) { delete task; }
+
+size_t cvat_image_count(const cvat_task *task)
+{
+    return task == nullptr ? 0 : task->image_names.size();
+}
+
+size_t cvat_label_count(const cvat_task *task)
+{
+    return task == nullptr ? 0 : task->label_names.size();
+}
+
+const char *cvat_image_name(const cvat_task *task, size_t image)
+{
+    if (task == nullptr || image >= task->image_names.size())
+        return nullptr;
+    return task->image_names[image].c_str();
+}
+
+const char *cvat_label_name(const cvat_task *task, size_t label)
+{
+    if (task == nullptr || label >= task->label_names.size())
+        return nullptr;
+    return task->label_names[label].c_str();
+}
+
+cvat_status cvat_image_size(const cvat_task *task, size_t image,
+                            uint32_t *width, uint32_t *height)
+{
+    return guarded(
+        [&]
+        {
+            if (task == nullptr || width == nullptr || height == nullptr ||
+                image >= task->image_names.size())
+            {
+                return fail(CVAT_ERROR_ARGUMENT, "invalid image");
+            }
+            if (task->index)
+            {
+                const auto img = task->index->image(image);
+                *width = (uint32_t)img.width();
+                *height = (uint32_t)img.height();
+            }
+            else
+            {
+                *width = (uint32_t)task->images[image].width();
+                *height = (uint32_t)task->images[image].height();
+            }
+            return CVAT_OK;
+        });
+}
+
+cvat_status cvat_render(const cvat_task *task, size_t image, size_t label,
+                        uint8_t *buffer, size_t stride)
+{
+    return guarded(
+        [&]
+        {
+            if (task == nullptr)
+                return fail(CVAT_ERROR_ARGUMENT, "task is required");
+            return render(*task, image, label, buffer, stride);
+        });
+}
+
+cvat_status cvat_render_batch(const cvat_task *task,
+                              cvat_render_request *requests, size_t count,
+                              unsigned threads)
+{
+    return guarded(
+        [&]
+        {
+            if (task == nullptr || (requests == nullptr && count > 0))
+            {
+                return fail(CVAT_ERROR_ARGUMENT,
+                            "task and requests are required");
+            }
+
+            // messages are recorded on the worker threads, keep the one of
+            // the first failed request
+            std::mutex error_mutex;
+            size_t first_failed = count;
+            std::string first_error;
+            parallel_for(
+                count,
+                [&](size_t i)
+                {
+                    auto &r = requests[i];
+                    r.status = guarded(
+                        [&] {
+                            return render(*task, r.image, r.label, r.buffer,
+                                          r.stride);
+                        });
+                    if (r.status != CVAT_OK)
+                    {
+                        std::lock_guard lock{error_mutex};
+                        if (i < first_failed)
+                        {
+                            first_failed = i;
+                            first_error = last_error;
+                        }
+                    }
+                },
+                threads);
+
+            if (first_failed < count)
+                return fail(requests[first_failed].status, first_error);
+            return CVAT_OK;
+        });
+}
+
+} // extern "C"
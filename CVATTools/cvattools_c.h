@@ -0,0 +1,100 @@
+/* cvattools_c.h : C API of libcvattools.
+ *
+ * Opens a CVAT annotations.xml, or an index built with --index, and renders
+ * label masks into buffers owned by the caller. Nothing is written to disk
+ * and no process is spawned, so it can be called from Python (ctypes/cffi)
+ * or Rust directly.
+ *
+ * Masks are 8 bit, 255 inside the label and 0 outside, height rows of
+ * `stride` bytes of which the first width bytes are written. They have the
+ * same pixels as the binary masks the command line tool writes without
+ * --spans.
+ *
+ * All functions returning cvat_status store a message for failures, which
+ * cvat_last_error() returns for the calling thread. A cvat_task can be used
+ * from several threads at once.
+ */
+
+#ifndef CVATTOOLS_C_H
+#define CVATTOOLS_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(CVATTOOLS_BUILD)
+#define CVAT_API __declspec(dllexport)
+#else
+#define CVAT_API __declspec(dllimport)
+#endif
+#else
+#define CVAT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CVAT_API_VERSION 1
+
+typedef enum cvat_status
+{
+    CVAT_OK = 0,
+    CVAT_ERROR_ARGUMENT = 1,  /* null pointer or index out of range */
+    CVAT_ERROR_IO = 2,        /* file cannot be opened or read */
+    CVAT_ERROR_PARSE = 3,     /* malformed XML or index */
+    CVAT_ERROR_BUFFER = 4,    /* stride smaller than the image width */
+    CVAT_ERROR_INTERNAL = 5
+} cvat_status;
+
+typedef struct cvat_task cvat_task;
+
+typedef struct cvat_render_request
+{
+    size_t image;
+    size_t label;
+    uint8_t *buffer; /* height * stride bytes */
+    size_t stride;
+    cvat_status status; /* set by cvat_render_batch */
+} cvat_render_request;
+
+/* CVAT_API_VERSION the library was built with. */
+CVAT_API int cvat_api_version(void);
+
+/* Message of the last failed call on this thread, "" if there was none. */
+CVAT_API const char *cvat_last_error(void);
+
+/* Opens an annotations.xml or an index file, detected by its content. */
+CVAT_API cvat_status cvat_open(const char *path, cvat_task **task);
+
+CVAT_API void cvat_close(cvat_task *task);
+
+CVAT_API size_t cvat_image_count(const cvat_task *task);
+
+CVAT_API size_t cvat_label_count(const cvat_task *task);
+
+/* Names are valid until cvat_close(), NULL for an invalid index. */
+CVAT_API const char *cvat_image_name(const cvat_task *task, size_t image);
+
+CVAT_API const char *cvat_label_name(const cvat_task *task, size_t label);
+
+CVAT_API cvat_status cvat_image_size(const cvat_task *task, size_t image,
+                                     uint32_t *width, uint32_t *height);
+
+/* Renders the union of all shapes of `label` in `image` into `buffer`. */
+CVAT_API cvat_status cvat_render(const cvat_task *task, size_t image,
+                                 size_t label, uint8_t *buffer,
+                                 size_t stride);
+
+/* Renders all requests on `threads` workers, 0 uses one per hardware
+ * thread. Every request gets its own status, the result is CVAT_OK if all
+ * of them succeeded and the first failure otherwise. */
+CVAT_API cvat_status cvat_render_batch(const cvat_task *task,
+                                       cvat_render_request *requests,
+                                       size_t count, unsigned threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
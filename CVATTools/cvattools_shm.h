@@ -0,0 +1,88 @@
+/* cvattools_shm.h : layout of the shared memory ring CVATTools renders
+ * masks into when OUTDIR is shm://<name>.
+ *
+ * The segment is created with shm_open("/<name>") and holds
+ *
+ *   cvat_shm_header
+ *   slot_count times { cvat_shm_slot, payload }, slot_size bytes apart
+ *
+ * A payload is a raw 8 bit mask, height rows of width bytes, 255 inside the
+ * label and 0 outside. Producers render straight into it, the consumer reads
+ * it in place.
+ *
+ * The ring is a bounded queue with one sequence number per slot. For the
+ * n-th mask (counting from 0) and slot_count N:
+ *
+ *   slot n % N is free for the producer when  sequence == n
+ *   slot n % N holds the n-th mask when       sequence == n + 1
+ *
+ * A consumer reads in order: wait until the slot's sequence is
+ * read_index + 1, use the mask, store read_index + N into the sequence to
+ * hand the slot back, then increment read_index. There is one consumer.
+ * When status is no longer CVAT_SHM_RUNNING and read_index == write_index,
+ * no more masks will come. The consumer unlinks the segment when done.
+ *
+ * Fields marked atomic must be accessed with atomic loads and stores,
+ * acquire for loads and release for stores. magic is written last, so it
+ * can be polled to wait for the producer.
+ */
+
+#ifndef CVATTOOLS_SHM_H
+#define CVATTOOLS_SHM_H
+
+#include <stdint.h>
+
+#define CVAT_SHM_MAGIC 0x4B534D43u /* "CMSK" */
+#define CVAT_SHM_VERSION 1u
+#define CVAT_SHM_IMAGE_SIZE 256
+#define CVAT_SHM_LABEL_SIZE 64
+
+enum cvat_shm_status
+{
+    CVAT_SHM_RUNNING = 0,
+    CVAT_SHM_FINISHED = 1,
+    CVAT_SHM_FAILED = 2
+};
+
+typedef struct cvat_shm_header
+{
+    uint32_t magic;   /* atomic, CVAT_SHM_MAGIC once initialized */
+    uint32_t version; /* CVAT_SHM_VERSION */
+    uint32_t slot_count;
+    uint32_t status;           /* atomic, enum cvat_shm_status */
+    uint64_t slot_size;        /* distance between two slots in bytes */
+    uint64_t payload_capacity; /* maximum width * height of a mask */
+    uint64_t write_index;      /* atomic, masks claimed by producers */
+    uint64_t read_index;       /* masks consumed, owned by the consumer */
+    uint64_t image_count;
+    uint32_t label_count;
+    uint32_t reserved;
+} cvat_shm_header;
+
+typedef struct cvat_shm_slot
+{
+    uint64_t sequence; /* atomic, see above */
+    uint32_t width;
+    uint32_t height;
+    uint32_t image_index;
+    uint32_t label_index;
+    uint8_t reserved[40];
+    char image[CVAT_SHM_IMAGE_SIZE]; /* zero terminated, may be truncated */
+    char label[CVAT_SHM_LABEL_SIZE]; /* zero terminated, may be truncated */
+} cvat_shm_slot;
+
+/* Slot i of the ring. */
+static inline cvat_shm_slot *cvat_shm_slot_at(cvat_shm_header *header,
+                                              uint64_t i)
+{
+    return (cvat_shm_slot *)((char *)header + sizeof(cvat_shm_header) +
+                             (i % header->slot_count) * header->slot_size);
+}
+
+/* Mask of a slot, width * height bytes. */
+static inline uint8_t *cvat_shm_payload(cvat_shm_slot *slot)
+{
+    return (uint8_t *)slot + sizeof(cvat_shm_slot);
+}
+
+#endif
@@ -0,0 +1,173 @@
+// annotation_stream_test.cpp : images cut out of the stream by
+// AnnotationStream decode to the same shapes as the images of the whole
+// document loaded by pugixml. The document is several chunks long, so
+// elements straddle the buffer refills.
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "AnnotationStream.h"
+#include "CVATTools.h"
+#include "check.h"
+
+namespace
+{
+std::string make_document(size_t image_count)
+{
+    std::mt19937 rng{3};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+    auto points = [&](int count)
+    {
+        std::string result;
+        for (int i = 0; i < count; ++i)
+        {
+            result += (i == 0 ? "" : ";") + std::to_string(uniform(0, 999)) +
+                      "." + std::to_string(uniform(0, 100)) + "," +
+                      std::to_string(uniform(0, 999));
+        }
+        return result;
+    };
+
+    std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                      "<annotations>\n<version>1.1</version>\n<meta><task>"
+                      "<labels><label><name>car</name></label>"
+                      "<label><name>a&gt;b</name></label>"
+                      "<label><name>tree</name></label></labels>"
+                      "</task></meta>\n";
+    for (size_t i = 0; i < image_count; ++i)
+    {
+        // '>' and "/>" inside attribute values, tags only starting with
+        // "<image" and images without shapes
+        const std::string name =
+            i % 7 == 0 ? "dir/>" + std::to_string(i) + ".png"
+                       : "frame_" + std::to_string(i) + ".png";
+        if (i % 11 == 0)
+            xml += "<image_extra/>\n";
+        xml += "<image id=\"" + std::to_string(i) + "\" name=\"" + name +
+               "\" width=\"1000\" height=\"1000\"";
+        if (i % 5 == 0)
+        {
+            xml += "/>\n";
+            continue;
+        }
+        xml += ">\n";
+        for (int s = uniform(1, 12); s > 0; --s)
+        {
+            const char *labels[] = {"a>b", "car", "tree"};
+            const char *label = labels[s % 3];
+            switch (s % 5)
+            {
+            case 0:
+                xml += "<box label=\"" + std::string(label) +
+                       "\" xtl=\"10.5\" ytl=\"20\" xbr=\"" +
+                       std::to_string(uniform(30, 999)) + "\" ybr=\"400\" " +
+                       "z_order=\"" + std::to_string(uniform(-2, 3)) +
+                       "\"><attribute name=\"note\">x &gt; y</attribute>"
+                       "</box>\n";
+                break;
+            case 1:
+                xml += "<polyline label=\"" + std::string(label) +
+                       "\" points=\"" + points(uniform(2, 40)) + "\"/>\n";
+                break;
+            case 2:
+                xml += "<ellipse label=\"" + std::string(label) +
+                       "\" cx=\"500\" cy=\"400.5\" rx=\"" +
+                       std::to_string(uniform(1, 300)) +
+                       "\" ry=\"20\" rotation=\"33.5\"/>\n";
+                break;
+            case 3:
+                xml += "<tag label=\"" + std::string(label) + "\"/>\n";
+                break;
+            default:
+                xml += "<polygon label=\"" + std::string(label) +
+                       "\" points=\"" + points(uniform(3, 200)) + "\"/>\n";
+                break;
+            }
+        }
+        xml += "</image>\n";
+    }
+    xml += "</annotations>\n";
+    return xml;
+}
+
+// Everything for_each_shape hands out, one line per shape.
+std::vector<std::string> describe(const Image &image)
+{
+    std::vector<std::string> result;
+    result.push_back(std::string(image.filename()) + " " +
+                     std::to_string(image.width()) + "x" +
+                     std::to_string(image.height()));
+    image.for_each_shape(
+        [&](std::string_view label, const ShapeData &shape)
+        {
+            std::string line = std::string(label) + " " +
+                               std::to_string((int)shape.type) + " " +
+                               std::to_string(shape.rotation) + " " +
+                               std::to_string(shape.z_order);
+            for (int v : shape.values)
+                line += " " + std::to_string(v);
+            for (auto p : shape.points)
+                line += " " + std::to_string(p.x) + "," + std::to_string(p.y);
+            result.push_back(std::move(line));
+        });
+    return result;
+}
+} // namespace
+
+int main()
+{
+    const std::string xml = make_document(5000);
+    CHECK(xml.size() > 3 * (1 << 20));
+
+    pugi::xml_document whole;
+    CHECK(whole.load_string(xml.c_str()));
+    const CVATMaskGenerator generator{std::move(whole)};
+    std::vector<std::vector<std::string>> expected;
+    for (auto &&image : generator.images())
+        expected.push_back(describe(image));
+    CHECK(expected.size() == 5000);
+
+    std::istringstream in{xml};
+    AnnotationStream stream{in};
+
+    pugi::xml_document meta;
+    CHECK(stream.next_meta(meta));
+    std::vector<std::string_view> labels;
+    for (auto &&l :
+         meta.child("meta").child("task").child("labels").children())
+        labels.push_back(l.child("name").text().as_string());
+    const auto generator_labels = generator.labels();
+    CHECK(std::equal(labels.begin(), labels.end(), generator_labels.begin(),
+                     generator_labels.end()));
+
+    pugi::xml_document doc;
+    size_t images = 0;
+    size_t mismatches = 0;
+    while (stream.next_image(doc))
+    {
+        const Image image{doc.child("image")};
+        if (images >= expected.size() || describe(image) != expected[images])
+            ++mismatches;
+        ++images;
+    }
+    CHECK(images == expected.size());
+    CHECK(mismatches == 0);
+
+    // a truncated document ends the stream early but never yields a
+    // partial image
+    std::istringstream truncated{xml.substr(0, xml.size() / 2)};
+    AnnotationStream partial{truncated};
+    size_t partial_images = 0;
+    while (partial.next_image(doc))
+    {
+        CHECK(describe(Image{doc.child("image")}) ==
+              expected[partial_images]);
+        ++partial_images;
+    }
+    CHECK(partial_images > 0 && partial_images < expected.size());
+
+    return check::result();
+}
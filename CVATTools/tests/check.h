@@ -0,0 +1,45 @@
+// check.h : minimal assertions for the CTest unit tests. Every test is a
+// program that returns check::result() from main, so a failed CHECK fails
+// the test without stopping at the first mismatch.
+
+#pragma once
+
+#include <iostream>
+
+namespace check
+{
+inline int &failures()
+{
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char *file, int line, const char *expression)
+{
+    std::cerr << file << ":" << line << ": CHECK(" << expression
+              << ") failed\n";
+    ++failures();
+}
+
+inline int result() { return failures() == 0 ? 0 : 1; }
+} // namespace check
+
+#define CHECK(expression)                                                    \
+    ((expression) ? (void)0 : check::fail(__FILE__, __LINE__, #expression))
+
+// Passes if `statement` throws std::exception.
+#define CHECK_THROWS(statement)                                              \
+    do                                                                       \
+    {                                                                        \
+        bool thrown = false;                                                 \
+        try                                                                  \
+        {                                                                    \
+            statement;                                                       \
+        }                                                                    \
+        catch (const std::exception &)                                       \
+        {                                                                    \
+            thrown = true;                                                   \
+        }                                                                    \
+        if (!thrown)                                                         \
+            check::fail(__FILE__, __LINE__, #statement " throws");           \
+    } while (false)
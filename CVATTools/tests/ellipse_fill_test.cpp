@@ -0,0 +1,64 @@
+// ellipse_fill_test.cpp : SpanMask::fill_ellipse sets exactly the pixels of
+// a filled cv::ellipse, for small and huge axes, fractional angles and
+// ellipses partly or fully outside the image.
+
+#include <algorithm>
+#include <random>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "Raster.h"
+#include "SpanMask.h"
+#include "check.h"
+
+int main()
+{
+    constexpr int width = 320;
+    constexpr int height = 240;
+    std::mt19937 rng{77};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+
+    // the axes pick the delta of cv::ellipse2Poly, cover every step
+    constexpr int max_axes[] = {6, 20, 120, 400};
+    int failed = 0;
+    constexpr int count = 4000;
+    for (int i = 0; i < count; ++i)
+    {
+        const int max_axis = max_axes[i % 4];
+        const cv::Point center{uniform(-60, width + 60),
+                               uniform(-60, height + 60)};
+        const cv::Size axes{uniform(0, max_axis + 1),
+                            uniform(0, max_axis + 1)};
+        // whole, half and arbitrary degrees, also beyond +-360
+        const double angle =
+            i % 3 == 0 ? uniform(-400, 400) + 0.5
+                       : uniform(-720000, 720000) / 1000.0;
+
+        cv::Mat expected(height, width, CV_8UC1, cv::Scalar(0));
+        cv::ellipse(expected, center, axes, angle, 0, 360, 255, cv::FILLED);
+
+        SpanMask spans(width, height);
+        spans.fill_ellipse(center, axes, angle);
+        spans.finalize();
+        cv::Mat actual(height, width, CV_8UC1, cv::Scalar(0));
+        paint<SetPixel>(spans, Raster<uint8_t>{actual.ptr(), actual.step1()},
+                        (uint8_t)255);
+
+        bool same = true;
+        for (int y = 0; y < height; ++y)
+            same &= std::equal(expected.ptr(y), expected.ptr(y) + width,
+                               actual.ptr(y));
+        if (!same && ++failed <= 5)
+        {
+            std::cerr << "center " << center.x << "," << center.y << " axes "
+                      << axes.width << "x" << axes.height << " angle "
+                      << angle << " differs\n";
+        }
+    }
+    if (failed != 0)
+        std::cerr << failed << " of " << count << " ellipses differ\n";
+    CHECK(failed == 0);
+    return check::result();
+}
@@ -0,0 +1,197 @@
+// index_test.cpp : shapes written with AnnotationIndexWriter read back
+// unchanged from AnnotationIndex, together with labels, postings and the
+// options the index was built with.
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "AnnotationIndex.h"
+#include "check.h"
+
+namespace
+{
+struct StoredShape
+{
+    std::vector<cv::Point> points;
+    ShapeData data;
+    std::string label;
+    std::optional<unsigned> group;
+};
+
+struct StoredImage
+{
+    std::string name;
+    uint32_t width;
+    uint32_t height;
+    std::vector<StoredShape> shapes;
+};
+
+bool same_shape(const ShapeData &a, const ShapeData &b)
+{
+    return a.type == b.type && a.rotation == b.rotation &&
+           a.z_order == b.z_order &&
+           std::equal(std::begin(a.values), std::end(a.values),
+                      std::begin(b.values)) &&
+           std::equal(a.points.begin(), a.points.end(), b.points.begin(),
+                      b.points.end(), [](cv::Point p, cv::Point q)
+                      { return p.x == q.x && p.y == q.y; });
+}
+} // namespace
+
+int main()
+{
+    const auto file =
+        std::filesystem::temp_directory_path() / "cvattools_index_test.idx";
+    const std::string labels[] = {"car", "truck", "person with hat"};
+    const ShapeType types[] = {ShapeType::polygon, ShapeType::box,
+                               ShapeType::points, ShapeType::polyline,
+                               ShapeType::ellipse};
+
+    std::mt19937 rng{5};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+
+    // images without shapes at the start, in the middle and at the end
+    std::vector<StoredImage> images(40);
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        auto &image = images[i];
+        image.name = "frame_" + std::to_string(i) + ".png";
+        image.width = (uint32_t)uniform(1, 2000);
+        image.height = (uint32_t)uniform(1, 2000);
+        const int shapes = i % 13 == 0 || i + 1 == images.size()
+                               ? 0
+                               : uniform(1, 8);
+        image.shapes.resize((size_t)shapes);
+        for (auto &shape : image.shapes)
+        {
+            shape.label = labels[uniform(0, 3)];
+            if (uniform(0, 2) == 0)
+                shape.group = (unsigned)uniform(0, 100);
+            shape.data.type = types[uniform(0, 5)];
+            const bool has_points = shape.data.type == ShapeType::polygon ||
+                                    shape.data.type == ShapeType::points ||
+                                    shape.data.type == ShapeType::polyline;
+            for (int p = has_points ? uniform(1, 30) : 0; p > 0; --p)
+                shape.points.push_back(
+                    {uniform(-50, 2000), uniform(-50, 2000)});
+            for (int &v : shape.data.values)
+                v = uniform(-100, 2000);
+            shape.data.rotation = (float)uniform(0, 3600) / 10.f;
+            shape.data.z_order = uniform(-3, 4);
+            // the writer classifies polygons that were not yet
+            if (i % 2 == 0)
+                shape.data.monotone =
+                    shape.data.type == ShapeType::polygon &&
+                    SpanMask::is_monotone(shape.points);
+        }
+    }
+
+    const IndexOptions options{1.5, 0x1234abcdULL};
+    {
+        AnnotationIndexWriter writer{file, options};
+        for (auto &image : images)
+        {
+            writer.begin_image(image.name, image.width, image.height);
+            for (auto &shape : image.shapes)
+            {
+                shape.data.points = shape.points;
+                writer.add_shape(shape.data, shape.label, shape.group);
+            }
+        }
+        writer.finish();
+    }
+
+    CHECK(AnnotationIndex::is_index_file(file));
+    CHECK(AnnotationIndex::is_current(file, options));
+    CHECK(!AnnotationIndex::is_current(file, {}));
+    CHECK(!AnnotationIndex::is_current(file, {1.5, 0}));
+    CHECK(!AnnotationIndex::is_current(file, {2.0, 0x1234abcdULL}));
+
+    {
+        const AnnotationIndex index{file};
+        CHECK(index.image_count() == images.size());
+
+        // labels get their id in order of first use
+        const auto index_labels = index.labels();
+        std::vector<std::string> first_use;
+        for (auto &image : images)
+        {
+            for (auto &shape : image.shapes)
+            {
+                if (std::find(first_use.begin(), first_use.end(),
+                              shape.label) == first_use.end())
+                    first_use.push_back(shape.label);
+            }
+        }
+        CHECK(std::equal(index_labels.begin(), index_labels.end(),
+                         first_use.begin(), first_use.end()));
+
+        size_t shape_count = 0;
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            const auto &expected = images[i];
+            const auto image = index.image(i);
+            CHECK(image.filename() == expected.name);
+            CHECK(image.width() == expected.width);
+            CHECK(image.height() == expected.height);
+            CHECK(image.shape_count() == expected.shapes.size());
+            shape_count += expected.shapes.size();
+
+            size_t s = 0;
+            image.for_each_shape(
+                [&](uint32_t label, const ShapeData &shape)
+                {
+                    const auto &stored = expected.shapes[s++];
+                    CHECK(index_labels[label] == stored.label);
+                    CHECK(same_shape(shape, stored.data));
+                    CHECK(shape.monotone ==
+                          (stored.data.type == ShapeType::polygon &&
+                           SpanMask::is_monotone(stored.points)));
+                });
+            CHECK(s == expected.shapes.size());
+        }
+        CHECK(index.shape_count() == shape_count);
+
+        // postings against a plain count over the shapes
+        for (auto &label : labels)
+        {
+            for (size_t min_instances : {1, 2, 4})
+            {
+                std::vector<std::string_view> expected;
+                for (auto &image : images)
+                {
+                    const auto instances = std::count_if(
+                        image.shapes.begin(), image.shapes.end(),
+                        [&](const StoredShape &shape)
+                        { return shape.label == label; });
+                    if (instances > 0 &&
+                        (size_t)instances >= min_instances)
+                        expected.push_back(image.name);
+                }
+                const auto found =
+                    index.images_with_label(label, min_instances);
+                CHECK(std::equal(found.begin(), found.end(),
+                                 expected.begin(), expected.end()));
+            }
+        }
+        CHECK(index.images_with_label("bus").empty());
+    }
+
+    // anything else is rejected
+    {
+        std::ofstream(file, std::ios::binary | std::ios::trunc)
+            << "<annotations></annotations>";
+    }
+    CHECK(!AnnotationIndex::is_index_file(file));
+    CHECK(!AnnotationIndex::is_current(file, {}));
+    CHECK_THROWS(AnnotationIndex{file});
+
+    std::filesystem::remove(file);
+    return check::result();
+}
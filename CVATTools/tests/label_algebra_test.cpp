@@ -0,0 +1,109 @@
+// label_algebra_test.cpp : parsing of --derive expressions, rejection of bad
+// ones, and their evaluation on packed masks against a per-pixel reference.
+
+#include <functional>
+#include <random>
+
+#include "LabelAlgebra.h"
+#include "Raster.h"
+#include "check.h"
+
+namespace
+{
+// 70 pixels wide, so every row has a partial second word whose padding
+// must stay clear
+constexpr size_t width = 70;
+constexpr size_t height = 5;
+constexpr size_t words_per_row = (width + 63) / 64;
+
+bool bit(const std::vector<uint64_t> &mask, size_t x, size_t y)
+{
+    return (mask[y * words_per_row + x / 64] >> (x % 64)) & 1;
+}
+
+// Evaluates `definition` on the masks of the labels a, b and c and compares
+// every pixel and the padding with `expected`.
+void check_expression(
+    const std::string &definition,
+    const std::vector<std::vector<uint64_t>> &masks,
+    const std::function<bool(bool, bool, bool)> &expected)
+{
+    const auto expression = LabelExpression::parse(definition);
+    std::vector<const uint64_t *> operands;
+    for (auto &&label : expression.labels())
+        operands.push_back(masks[(size_t)(label[0] - 'a')].data());
+    const auto result = expression.evaluate(operands, width, height);
+    CHECK(result.size() == words_per_row * height);
+
+    bool same = true;
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < words_per_row * 64; ++x)
+        {
+            const bool want = x < width && expected(bit(masks[0], x, y),
+                                                    bit(masks[1], x, y),
+                                                    bit(masks[2], x, y));
+            same &= bit(result, x, y) == want;
+        }
+    }
+    if (!same)
+        std::cerr << "mismatch in " << definition << '\n';
+    CHECK(same);
+}
+} // namespace
+
+int main()
+{
+    // parsing
+    const auto vehicle = LabelExpression::parse("vehicle = car | big truck");
+    CHECK(vehicle.name() == "vehicle");
+    CHECK(vehicle.labels() ==
+          (std::vector<std::string>{"car", "big truck"}));
+    const auto body = LabelExpression::parse("body=car&~wheel&car");
+    CHECK(body.labels() == (std::vector<std::string>{"car", "wheel"}));
+
+    for (const char *bad : {"", "car", "=car", " =car", "v=", "v=car|",
+                            "v=(car", "v=car)", "v=car&&bus", "v=~",
+                            "v=car bus)", "v=()"})
+        CHECK_THROWS(LabelExpression::parse(bad));
+
+    // random masks of a, b and c, padding clear like paint_bits() leaves it
+    std::mt19937_64 rng{7};
+    std::vector<std::vector<uint64_t>> masks(3);
+    for (auto &&mask : masks)
+    {
+        mask.resize(words_per_row * height);
+        for (size_t y = 0; y < height; ++y)
+        {
+            mask[y * words_per_row] = rng();
+            mask[y * words_per_row + 1] = rng() & ((1u << (width - 64)) - 1);
+        }
+    }
+
+    check_expression("v=a", masks, [](bool a, bool, bool) { return a; });
+    check_expression("v=a|b|c", masks,
+                     [](bool a, bool b, bool c) { return a || b || c; });
+    check_expression("v=a&~b", masks,
+                     [](bool a, bool b, bool) { return a && !b; });
+    check_expression("v=~a", masks, [](bool a, bool, bool) { return !a; });
+    check_expression("v=a|b&c", masks,
+                     [](bool a, bool b, bool c) { return a || (b && c); });
+    check_expression("v=(a|b)&c", masks,
+                     [](bool a, bool b, bool c) { return (a || b) && c; });
+    check_expression("v=a&~(b|c)", masks,
+                     [](bool a, bool b, bool c) { return a && !(b || c); });
+    check_expression("v=~(a&b)|~~c", masks,
+                     [](bool a, bool b, bool c) { return !(a && b) || c; });
+    check_expression("v=a & (~b)", masks,
+                     [](bool a, bool b, bool) { return a && !b; });
+
+    // unpack_spans() is the inverse of paint_bits()
+    for (auto &&mask : masks)
+    {
+        const auto spans = unpack_spans(mask, (int)width, (int)height);
+        std::vector<uint64_t> repacked(mask.size(), 0);
+        paint_bits(spans, Raster<uint64_t>{repacked.data(), words_per_row});
+        CHECK(repacked == mask);
+    }
+    return check::result();
+}
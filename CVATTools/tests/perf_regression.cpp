@@ -0,0 +1,600 @@
+// perf_regression.cpp : parse, render and encode throughput on a fixed
+// synthetic workload.
+//
+// Every metric is the best of several repetitions on a single thread, which
+// is much less noisy than the mean. Two kinds of checks use them:
+//
+// - Ratios between metrics of the same run, like span against dense
+//   rendering, hold across machines. The committed tests/perf_ratios.txt
+//   has a lower bound for each and is always checked.
+// - Absolute throughput only holds on one machine. A baseline recorded with
+//   --update notes the machine and build it was measured with, and a metric
+//   fails when it drops more than the tolerance below it. A baseline from
+//   another machine is reported and not compared.
+//
+// A stage with neither a ratio nor a usable baseline is skipped.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "Arena.h"
+#include "CLI11.hpp"
+#include "CVATTools.h"
+#include "PngWriter.h"
+#include "SpanMask.h"
+
+namespace
+{
+constexpr int image_count = 24;
+constexpr int image_width = 1920;
+constexpr int image_height = 1080;
+constexpr int shapes_per_image = 40;
+const std::vector<std::string> workload_labels = {
+    "car", "person", "road", "sky", "sign", "tree"};
+
+// CVAT annotations of `image_count` images, the same on every platform:
+// only the raw mt19937 output is specified by the standard, the
+// distributions are not. Mixed shapes or, with `quads`, only the rotated
+// rectangles and triangles of box-like annotation tools.
+std::string synthetic_annotations(bool quads)
+{
+    std::mt19937 rng{20220917};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+
+    std::ostringstream xml;
+    xml << std::fixed << std::setprecision(2);
+    xml << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<annotations>\n"
+           "  <version>1.1</version>\n  <meta><task><labels>\n";
+    for (const auto &label : workload_labels)
+        xml << "    <label><name>" << label << "</name></label>\n";
+    xml << "  </labels></task></meta>\n";
+
+    for (int i = 0; i < image_count; ++i)
+    {
+        xml << "  <image id=\"" << i << "\" name=\"cam" << i % 3
+            << "/frame_" << i << ".jpg\" width=\"" << image_width
+            << "\" height=\"" << image_height << "\">\n";
+        for (int s = 0; s < shapes_per_image; ++s)
+        {
+            const std::string &label =
+                workload_labels[rng() % workload_labels.size()];
+            const int cx = uniform(0, image_width);
+            const int cy = uniform(0, image_height);
+            const int r = uniform(20, 300);
+            const int kind = uniform(0, 10);
+            const int z = uniform(0, 4);
+            if (quads)
+            {
+                const int corners = kind < 8 ? 4 : 3;
+                const double rotation = uniform(0, 360) * CV_PI / 180.0;
+                xml << "    <polygon label=\"" << label
+                    << "\" occluded=\"0\" points=\"";
+                for (int v = 0; v < corners; ++v)
+                {
+                    const double angle = rotation + 2.0 * CV_PI * v / corners;
+                    xml << (v ? ";" : "") << cx + r * std::cos(angle) << ','
+                        << cy + r / 2 * std::sin(angle);
+                }
+                xml << "\" z_order=\"" << z << "\"/>\n";
+            }
+            else if (kind < 7)
+            {
+                // star shaped, so it is simple but rarely convex
+                const bool closed = kind < 6;
+                const int vertices = uniform(8, 65);
+                xml << "    <" << (closed ? "polygon" : "polyline")
+                    << " label=\"" << label << "\" occluded=\"0\" points=\"";
+                for (int v = 0; v < vertices; ++v)
+                {
+                    const double angle = 2.0 * CV_PI * v / vertices;
+                    const double radius = r * (0.6 + 0.4 * uniform(0, 1000) /
+                                                         1000.0);
+                    xml << (v ? ";" : "") << cx + radius * std::cos(angle)
+                        << ',' << cy + radius * std::sin(angle);
+                }
+                xml << "\" z_order=\"" << z << "\"/>\n";
+            }
+            else if (kind < 9)
+            {
+                xml << "    <box label=\"" << label
+                    << "\" occluded=\"0\" xtl=\"" << cx - r << "\" ytl=\""
+                    << cy - r / 2 << "\" xbr=\"" << cx + r << "\" ybr=\""
+                    << cy + r / 2 << "\" z_order=\"" << z << "\"/>\n";
+            }
+            else
+            {
+                xml << "    <ellipse label=\"" << label
+                    << "\" occluded=\"0\" cx=\"" << cx << "\" cy=\"" << cy
+                    << "\" rx=\"" << r << "\" ry=\"" << r / 2
+                    << "\" rotation=\"" << uniform(0, 180)
+                    << "\" z_order=\"" << z << "\"/>\n";
+            }
+        }
+        xml << "  </image>\n";
+    }
+    xml << "</annotations>\n";
+    return xml.str();
+}
+
+// Exit code telling CTest that the suite was skipped.
+constexpr int skipped = 77;
+
+// CPU, threads, compiler and build type a baseline is measured with.
+std::string machine_description()
+{
+    std::string cpu = "unknown CPU";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        const size_t colon = line.find(':');
+        if (line.starts_with("model name") && colon != std::string::npos)
+        {
+            cpu = line.substr(line.find_first_not_of(" \t", colon + 1));
+            break;
+        }
+    }
+
+    std::ostringstream result;
+    result << cpu << ", " << std::thread::hardware_concurrency()
+           << " threads, ";
+#if defined(__clang__)
+    result << "clang " << __clang_major__ << '.' << __clang_minor__;
+#elif defined(__GNUC__)
+    result << "gcc " << __GNUC__ << '.' << __GNUC_MINOR__;
+#elif defined(_MSC_VER)
+    result << "MSVC " << _MSC_VER;
+#endif
+#ifdef NDEBUG
+    result << ", optimized";
+#else
+    result << ", assertions on";
+#endif
+    return result.str();
+}
+
+// Fastest of `repetitions` runs of f, in seconds.
+template <typename F> double best_seconds(int repetitions, F &&f)
+{
+    double best = 1e300;
+    for (int r = 0; r < repetitions; ++r)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// "numerator denominator minimum" line of tests/perf_ratios.txt, the
+// numerator metric has to be at least `minimum` times the denominator.
+struct Ratio
+{
+    std::string numerator;
+    std::string denominator;
+    double minimum;
+};
+
+std::vector<Ratio> read_ratios(const std::filesystem::path &file)
+{
+    std::ifstream in(file);
+    if (!in)
+        throw std::runtime_error("Cannot open " + file.string());
+    std::vector<Ratio> result;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        Ratio ratio;
+        if (!(fields >> ratio.numerator >> ratio.denominator >> ratio.minimum))
+            throw std::runtime_error("Bad ratio line in " + file.string());
+        result.push_back(ratio);
+    }
+    return result;
+}
+
+constexpr std::string_view machine_prefix = "# measured on ";
+
+// Machine line of a baseline, empty if it has none.
+std::string baseline_machine(const std::filesystem::path &file)
+{
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.starts_with(machine_prefix))
+            return line.substr(machine_prefix.size());
+    }
+    return {};
+}
+
+std::map<std::string, double> read_baseline(const std::filesystem::path &file)
+{
+    std::map<std::string, double> result;
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        std::string name;
+        double value;
+        if (fields >> name >> value)
+            result[name] = value;
+    }
+    return result;
+}
+
+// Replaces the measured metrics and the machine line in `file` and keeps
+// everything else, comments included. A new file gets a description.
+void update_baseline(const std::filesystem::path &file,
+                     const std::map<std::string, double> &measured)
+{
+    const std::string machine =
+        std::string(machine_prefix) + machine_description();
+
+    std::vector<std::string> lines;
+    auto remaining = measured;
+    bool has_machine = false;
+    {
+        std::ifstream in(file);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (line.starts_with(machine_prefix))
+            {
+                lines.push_back(machine);
+                has_machine = true;
+                continue;
+            }
+            std::istringstream fields(line);
+            std::string name;
+            fields >> name;
+            auto it = remaining.find(name);
+            if (!line.empty() && line[0] != '#' && it != remaining.end())
+            {
+                std::ostringstream replaced;
+                replaced << name << ' ' << std::fixed << std::setprecision(1)
+                         << it->second;
+                line = replaced.str();
+                remaining.erase(it);
+            }
+            lines.push_back(line);
+        }
+    }
+    if (lines.empty())
+    {
+        lines = {
+            "# Throughput of perf_regression, one \"metric value\" line each,",
+            "# bigger is better. parse is in MB of XML per second, render and",
+            "# encode in megapixels per second, all on a single thread. The",
+            "# numbers only hold for the machine and build below."};
+    }
+    if (!has_machine)
+        lines.push_back(machine);
+    for (auto &&[name, value] : remaining)
+    {
+        std::ostringstream added;
+        added << name << ' ' << std::fixed << std::setprecision(1) << value;
+        lines.push_back(added.str());
+    }
+
+    std::ofstream out(file);
+    for (const auto &line : lines)
+        out << line << '\n';
+    if (!out)
+        throw std::runtime_error("Cannot write " + file.string());
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    CLI::App app{"Throughput regression suite of CVATTools"};
+    std::string baseline_file;
+    app.add_option("--baseline", baseline_file,
+                   "Baseline of this machine to compare with");
+    std::string ratios_file;
+    app.add_option("--ratios", ratios_file,
+                   "Lower bounds of ratios between metrics")
+        ->check(CLI::ExistingFile);
+    std::string stage = "all";
+    app.add_option("--stage", stage, "Stage to measure")
+        ->check(CLI::IsMember({"parse", "render", "encode", "all"}));
+    double tolerance = 0.25;
+    app.add_option("--tolerance", tolerance,
+                   "Allowed slowdown as a fraction of the baseline")
+        ->check(CLI::Range(0.0, 1.0));
+    int repetitions = 5;
+    app.add_option("--repetitions", repetitions,
+                   "Runs per metric, the fastest counts")
+        ->check(CLI::PositiveNumber);
+    bool update = false;
+    app.add_flag("--update", update,
+                 "Write the measured throughput into the baseline instead of "
+                 "comparing");
+    CLI11_PARSE(app, argc, argv);
+    if (update && baseline_file.empty())
+    {
+        std::cerr << "--update needs --baseline\n";
+        return 1;
+    }
+
+    try
+    {
+        auto wants = [&](const char *s)
+        { return stage == "all" || stage == s; };
+
+        auto write_workload = [&](const std::string &name,
+                                  const std::string &xml)
+        {
+            const auto file = std::filesystem::temp_directory_path() /
+                              ("cvattools_perf_" + name + ".xml");
+            std::ofstream out(file, std::ios::binary);
+            out << xml;
+            if (!out)
+                throw std::runtime_error("Cannot write " + file.string());
+            return file;
+        };
+        const std::string xml = synthetic_annotations(false);
+        const auto xml_file = write_workload(stage, xml);
+        const auto quads_file =
+            write_workload(stage + "_quads", synthetic_annotations(true));
+        const double megabytes = xml.size() / 1e6;
+        const double megapixels = (double)image_count * image_width *
+                                  image_height * workload_labels.size() / 1e6;
+
+        // name -> throughput, bigger is better
+        std::map<std::string, double> measured;
+
+        if (wants("parse"))
+        {
+            // load the document and decode every shape, as the workers do
+            const double seconds = best_seconds(
+                repetitions,
+                [&]
+                {
+                    const auto generator =
+                        CVATMaskGenerator::from_file(xml_file.string());
+                    size_t points = 0;
+                    for (const auto &image : generator.images())
+                    {
+                        ScratchArena::Scope scope;
+                        image.for_each_shape(
+                            [&](auto &&, const ShapeData &shape)
+                            { points += shape.points.size(); });
+                    }
+                    if (points == 0)
+                        throw std::runtime_error("Empty workload");
+                });
+            measured["parse_mb_per_s"] = megabytes / seconds;
+        }
+
+        const auto generator = CVATMaskGenerator::from_file(xml_file.string());
+        const std::vector<Image> images(generator.images().begin(),
+                                        generator.images().end());
+        const auto quads_generator =
+            CVATMaskGenerator::from_file(quads_file.string());
+        const std::vector<Image> quads(quads_generator.images().begin(),
+                                       quads_generator.images().end());
+
+        // calls render(image, label) for every mask of a workload
+        auto for_each_mask = [&](const std::vector<Image> &workload,
+                                 auto &&render)
+        {
+            for (const auto &image : workload)
+            {
+                ScratchArena::Scope scope;
+                for (const auto &label : workload_labels)
+                    render(image, label);
+            }
+        };
+
+        if (wants("render"))
+        {
+            // with spans, box-like polygons take the monotone polygon fill
+            const std::pair<const char *, const std::vector<Image> *>
+                workloads[] = {{"render", &images}, {"render_quads", &quads}};
+            for (auto &&[name, workload] : workloads)
+            {
+                measured[std::string(name) + "_dense_mpix_per_s"] =
+                    megapixels /
+                    best_seconds(repetitions,
+                                 [&]
+                                 {
+                                     for_each_mask(
+                                         *workload,
+                                         [](const Image &image,
+                                            const std::string &label)
+                                         { image.mask_combined(label); });
+                                 });
+                measured[std::string(name) + "_spans_mpix_per_s"] =
+                    megapixels /
+                    best_seconds(repetitions,
+                                 [&]
+                                 {
+                                     for_each_mask(
+                                         *workload,
+                                         [](const Image &image,
+                                            const std::string &label)
+                                         { image.spans_combined(label); });
+                                 });
+            }
+
+            // the polygon fills alone, monotone walker against edge table,
+            // on the quads decoded once
+            using Polygons = std::vector<std::vector<cv::Point>>;
+            // image -> label -> polygons
+            std::vector<std::vector<Polygons>> polygons;
+            for (const auto &image : quads)
+            {
+                auto &by_label = polygons.emplace_back(workload_labels.size());
+                image.for_each_shape(
+                    [&](std::string_view label, const ShapeData &shape)
+                    {
+                        const auto l = std::find(workload_labels.begin(),
+                                                 workload_labels.end(),
+                                                 label) -
+                                       workload_labels.begin();
+                        by_label[l].emplace_back(shape.points.begin(),
+                                                 shape.points.end());
+                    });
+            }
+            auto fill = [&](bool monotone)
+            {
+                for (const auto &by_label : polygons)
+                {
+                    for (const auto &shapes : by_label)
+                    {
+                        SpanMask mask(image_width, image_height);
+                        for (const auto &points : shapes)
+                        {
+                            if (monotone)
+                                mask.fill_monotone_polygon(points);
+                            else
+                                mask.fill_polygon(points);
+                        }
+                    }
+                }
+            };
+            measured["fill_quads_edge_table_mpix_per_s"] =
+                megapixels /
+                best_seconds(repetitions, [&] { fill(false); });
+            measured["fill_quads_monotone_mpix_per_s"] =
+                megapixels / best_seconds(repetitions, [&] { fill(true); });
+        }
+
+        if (wants("encode"))
+        {
+            // rendered once up front, only the encoding is timed
+            std::vector<cv::Mat> masks;
+            std::vector<SpanMask> spans;
+            for_each_mask(
+                images, [&](const Image &image, const std::string &label)
+                {
+                    masks.push_back(image.mask_combined(label));
+                    spans.push_back(image.spans_combined(label));
+                });
+            std::vector<uchar> png;
+            measured["encode_dense_mpix_per_s"] =
+                megapixels / best_seconds(repetitions,
+                                          [&]
+                                          {
+                                              for (const auto &mask : masks)
+                                                  cv::imencode(".png", mask,
+                                                               png);
+                                          });
+            measured["encode_spans_mpix_per_s"] =
+                megapixels / best_seconds(repetitions,
+                                          [&]
+                                          {
+                                              for (const auto &mask : spans)
+                                                  png = encode_png(mask);
+                                          });
+        }
+
+        std::filesystem::remove(xml_file);
+        std::filesystem::remove(quads_file);
+
+        if (update)
+        {
+            update_baseline(baseline_file, measured);
+            for (auto &&[name, value] : measured)
+                std::cout << name << ' ' << value << '\n';
+            return 0;
+        }
+
+        bool regressed = false;
+        bool checked = false;
+        const auto ratios = ratios_file.empty() ? std::vector<Ratio>{}
+                                                : read_ratios(ratios_file);
+        std::cout << std::fixed << std::setprecision(2);
+        for (auto &&ratio : ratios)
+        {
+            auto numerator = measured.find(ratio.numerator);
+            auto denominator = measured.find(ratio.denominator);
+            if (numerator == measured.end() ||
+                denominator == measured.end())
+                continue;
+            const double value = numerator->second / denominator->second;
+            const bool failed = value < ratio.minimum;
+            regressed |= failed;
+            checked = true;
+            std::cout << ratio.numerator << " / " << ratio.denominator
+                      << " = " << value << ", at least " << ratio.minimum
+                      << (failed ? "  REGRESSED" : "") << '\n';
+        }
+
+        if (baseline_file.empty() ||
+            !std::filesystem::exists(baseline_file))
+        {
+            std::cout << "No baseline of this machine, record one with "
+                         "--update to compare absolute throughput\n";
+            return checked ? (regressed ? 1 : 0) : skipped;
+        }
+        const std::string machine = machine_description();
+        const std::string measured_on = baseline_machine(baseline_file);
+        if (measured_on != machine)
+        {
+            std::cout << "Baseline measured on " << measured_on
+                      << ", this is " << machine
+                      << ": absolute throughput not compared\n";
+            return checked ? (regressed ? 1 : 0) : skipped;
+        }
+
+        const auto baseline = read_baseline(baseline_file);
+        std::cout << std::left << std::setw(34) << "metric" << std::right
+                  << std::setw(12) << "measured" << std::setw(12)
+                  << "baseline" << std::setw(9) << "ratio" << '\n';
+        std::cout << std::fixed << std::setprecision(1);
+        for (auto &&[name, value] : measured)
+        {
+            std::cout << std::left << std::setw(34) << name << std::right
+                      << std::setw(12) << value;
+            auto it = baseline.find(name);
+            if (it == baseline.end() || it->second <= 0)
+            {
+                std::cout << std::setw(12) << "-" << "  no baseline\n";
+                continue;
+            }
+            const double ratio = value / it->second;
+            const bool failed = ratio < 1.0 - tolerance;
+            regressed |= failed;
+            std::cout << std::setw(12) << it->second << std::setw(8)
+                      << std::setprecision(2) << ratio << std::setprecision(1)
+                      << (failed ? "  REGRESSED" : "") << '\n';
+        }
+        if (regressed)
+        {
+            std::cerr << "Throughput dropped below a ratio or more than "
+                      << tolerance * 100 << "% below the baseline\n";
+            return 1;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
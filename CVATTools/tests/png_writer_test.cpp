@@ -0,0 +1,104 @@
+// png_writer_test.cpp : encode_png output decodes with cv::imdecode to the
+// dense mask, for empty, full and random masks of odd sizes and for masks
+// large enough to span several IDAT chunks.
+
+#include <algorithm>
+#include <random>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "PngWriter.h"
+#include "Raster.h"
+#include "SpanMask.h"
+#include "check.h"
+
+namespace
+{
+// Decodes `mask` from its PNG and compares it pixel by pixel with the mask
+// painted into a Mat.
+bool decodes_to(const SpanMask &mask, int width, int height,
+                unsigned char value)
+{
+    const std::vector<unsigned char> png = encode_png(mask, value);
+    const cv::Mat decoded = cv::imdecode(png, cv::IMREAD_UNCHANGED);
+    if (decoded.empty() || decoded.type() != CV_8UC1 ||
+        decoded.cols != width || decoded.rows != height)
+    {
+        return false;
+    }
+
+    cv::Mat expected(height, width, CV_8UC1, cv::Scalar(0));
+    paint<SetPixel>(mask, Raster<uint8_t>{expected.ptr(), expected.step1()},
+                    value);
+    for (int y = 0; y < height; ++y)
+    {
+        if (!std::equal(expected.ptr(y), expected.ptr(y) + width,
+                        decoded.ptr(y)))
+            return false;
+    }
+    return true;
+}
+} // namespace
+
+int main()
+{
+    std::mt19937 rng{13};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+
+    // empty and full masks, one pixel wide and high
+    for (auto [width, height] : {std::pair{1, 1}, {1, 37}, {53, 1}})
+    {
+        SpanMask empty(width, height);
+        empty.finalize();
+        CHECK(decodes_to(empty, width, height, 255));
+
+        SpanMask full(width, height);
+        full.fill_rect(0, 0, width, height);
+        full.finalize();
+        CHECK(decodes_to(full, width, height, 255));
+    }
+
+    // overlapping rectangles and ellipses, any label value
+    int failed = 0;
+    constexpr int count = 300;
+    for (int i = 0; i < count; ++i)
+    {
+        const int width = uniform(1, 400);
+        const int height = uniform(1, 300);
+        SpanMask mask(width, height);
+        for (int s = uniform(0, 12); s > 0; --s)
+        {
+            const cv::Point center{uniform(-20, width + 20),
+                                   uniform(-20, height + 20)};
+            if (s % 2 == 0)
+                mask.fill_rect(center.x, center.y, uniform(1, width + 1),
+                               uniform(1, height + 1));
+            else
+                mask.fill_ellipse(center, {uniform(0, 80), uniform(0, 80)},
+                                  uniform(0, 360));
+        }
+        mask.finalize();
+        if (!decodes_to(mask, width, height, (unsigned char)uniform(1, 256)))
+            ++failed;
+    }
+    CHECK(failed == 0);
+
+    // several megabytes of scanlines, the encoder flushes many IDAT chunks
+    {
+        constexpr int width = 4000;
+        constexpr int height = 3000;
+        SpanMask mask(width, height);
+        for (int y = 0; y < height; y += 3)
+        {
+            const int x = y * 7 % width;
+            mask.add_span(y, x, x + 17 + y % 300);
+        }
+        mask.fill_ellipse({width / 2, height / 2}, {1500, 900}, 30);
+        mask.finalize();
+        CHECK(decodes_to(mask, width, height, 255));
+    }
+
+    return check::result();
+}
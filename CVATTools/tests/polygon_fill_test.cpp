@@ -0,0 +1,100 @@
+// polygon_fill_test.cpp : SpanMask::fill_monotone_polygon sets exactly the
+// pixels of SpanMask::fill_polygon for every polygon is_monotone accepts,
+// including polygons that are partly or fully outside the mask.
+
+#include <cmath>
+#include <random>
+
+#include "SpanMask.h"
+#include "check.h"
+
+namespace
+{
+constexpr int width = 160;
+constexpr int height = 120;
+
+bool same_spans(const SpanMask &a, const SpanMask &b)
+{
+    const auto l = a.spans();
+    const auto r = b.spans();
+    return std::equal(l.begin(), l.end(), r.begin(), r.end(),
+                      [](const Span &x, const Span &y) {
+                          return x.y == y.y && x.x0 == y.x0 && x.x1 == y.x1;
+                      });
+}
+
+// Fills `pts` both ways, false on a mismatch. Polygons is_monotone rejects
+// are skipped and count as passed.
+bool fills_agree(const std::vector<cv::Point> &pts, size_t &compared)
+{
+    if (!SpanMask::is_monotone(pts))
+        return true;
+    ++compared;
+    SpanMask table(width, height);
+    table.fill_polygon(pts);
+    table.finalize();
+    SpanMask walker(width, height);
+    walker.fill_monotone_polygon(pts);
+    walker.finalize();
+    return same_spans(table, walker);
+}
+} // namespace
+
+int main()
+{
+    // convex polygons are always monotone, a concave one is not
+    CHECK(SpanMask::is_monotone(
+        std::vector<cv::Point>{{0, 0}, {9, 0}, {9, 9}}));
+    CHECK(SpanMask::is_monotone(
+        std::vector<cv::Point>{{5, 0}, {9, 5}, {5, 9}, {0, 5}}));
+    CHECK(!SpanMask::is_monotone(
+        std::vector<cv::Point>{{0, 0}, {5, 8}, {9, 0}, {9, 9}, {0, 9}}));
+    CHECK(!SpanMask::is_monotone(std::vector<cv::Point>{{0, 0}, {9, 9}}));
+
+    std::mt19937 rng{98};
+    auto uniform = [&](int lo, int hi)
+    { return lo + (int)(rng() % (unsigned)(hi - lo)); };
+
+    size_t compared = 0;
+    size_t failed = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        // star shaped around a center that may be off the mask, with
+        // jittered radii: convex, monotone but concave, or neither
+        const int cx = uniform(-40, width + 40);
+        const int cy = uniform(-40, height + 40);
+        const int r = uniform(1, 150);
+        const int vertices = uniform(3, 12);
+        const double jitter = uniform(0, 3) * 0.2;
+        const double rotation = uniform(0, 360) * CV_PI / 180.0;
+        std::vector<cv::Point> pts;
+        for (int v = 0; v < vertices; ++v)
+        {
+            const double angle = rotation + 2.0 * CV_PI * v / vertices;
+            const double radius = r * (1.0 - jitter * uniform(0, 1000) / 1e3);
+            pts.emplace_back((int)std::lround(cx + radius * std::cos(angle)),
+                             (int)std::lround(cy + radius * std::sin(angle)));
+        }
+        if (!fills_agree(pts, compared))
+            ++failed;
+
+        // axis aligned and sheared boxes, with horizontal edges and
+        // repeated vertices
+        const int w = uniform(0, 80);
+        const int h = uniform(0, 80);
+        const int shear = uniform(-20, 21);
+        const std::vector<cv::Point> box = {{cx, cy},
+                                            {cx + w, cy},
+                                            {cx + w, cy},
+                                            {cx + w + shear, cy + h},
+                                            {cx + shear, cy + h}};
+        if (!fills_agree(box, compared))
+            ++failed;
+    }
+    if (failed != 0)
+        std::cerr << failed << " of " << compared << " polygons differ\n";
+    CHECK(failed == 0);
+    // most of the random polygons have to reach the comparison
+    CHECK(compared > 20000);
+    return check::result();
+}
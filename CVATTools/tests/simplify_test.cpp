@@ -0,0 +1,108 @@
+// simplify_test.cpp : --simplify simplifies every shape once. However often
+// a shape is decoded afterwards, the --simplify-report has one row per
+// simplified shape and the decoded points stay the same.
+
+#include <sstream>
+#include <string>
+
+#include "CVATTools.h"
+#include "check.h"
+
+namespace
+{
+// `images` images with a square polygon of 4 * `side` vertices, most of
+// them collinear, a zigzag polyline, a box and a points shape each.
+std::string annotations(int images, int side)
+{
+    std::ostringstream xml;
+    xml << "<annotations><meta><task><labels>"
+           "<label><name>car</name></label>"
+           "<label><name>road</name></label>"
+           "</labels></task></meta>\n";
+    for (int i = 0; i < images; ++i)
+    {
+        xml << "<image id=\"" << i << "\" name=\"" << i
+            << ".jpg\" width=\"200\" height=\"200\">";
+        // walks the corners, `side` vertices per edge
+        const cv::Point corners[] = {
+            {10, 10}, {110, 10}, {110, 110}, {10, 110}, {10, 10}};
+        xml << "<polygon label=\"car\" points=\"";
+        for (int k = 0; k < 4 * side; ++k)
+        {
+            const cv::Point a = corners[k / side];
+            const cv::Point b = corners[k / side + 1];
+            const int t = k % side;
+            xml << (k ? ";" : "") << a.x + (b.x - a.x) * t / side << ".25,"
+                << a.y + (b.y - a.y) * t / side << ".75";
+        }
+        xml << "\"/><polyline label=\"road\" points=\"";
+        for (int k = 0; k < side; ++k)
+            xml << (k ? ";" : "") << 5 + 3 * k << "," << 150 + k % 2;
+        xml << "\"/><box label=\"road\" xtl=\"1\" ytl=\"2\" xbr=\"30\" "
+               "ybr=\"40\"/><points label=\"car\" points=\"3,4;5,6;7,8\"/>"
+               "<tag label=\"car\"/></image>\n";
+    }
+    xml << "</annotations>\n";
+    return xml.str();
+}
+
+// Decoded points of every shape of the generator, in order.
+std::vector<std::vector<cv::Point>> decoded(const CVATMaskGenerator &g)
+{
+    std::vector<std::vector<cv::Point>> result;
+    for (auto &&image : g.images())
+    {
+        image.for_each_shape(
+            [&](std::string_view, const ShapeData &shape) {
+                result.emplace_back(shape.points.begin(), shape.points.end());
+            });
+    }
+    return result;
+}
+} // namespace
+
+int main()
+{
+    constexpr int images = 5;
+    constexpr int side = 20;
+    SimplificationStats stats;
+    ParseOptions options;
+    options.simplify_tolerance = 2.0;
+    options.simplification_stats = &stats;
+
+    pugi::xml_document doc;
+    CHECK(doc.load_string(annotations(images, side).c_str()));
+    const CVATMaskGenerator generator(std::move(doc), options);
+
+    // decode every shape several times, like rendering, --checksums and
+    // --derive do
+    const auto first = decoded(generator);
+    for (auto &&image : generator.images())
+    {
+        for (auto &&label : generator.labels())
+        {
+            image.mask_combined(label);
+            image.spans_combined(label);
+        }
+    }
+    const auto second = decoded(generator);
+
+    // one polygon and one polyline per image
+    const auto entries = stats.entries();
+    CHECK(entries.size() == 2 * images);
+    CHECK(first == second);
+
+    for (auto &&e : entries)
+    {
+        CHECK(e.vertices_after < e.vertices_before);
+        if (e.type == "polygon")
+        {
+            CHECK(e.vertices_before == 4 * side);
+            CHECK(e.vertices_after == 4);
+        }
+    }
+    // the polygon of the first image decodes to its simplified corners
+    CHECK(first.size() == 5 * images);
+    CHECK(first[0].size() == 4);
+    return check::result();
+}
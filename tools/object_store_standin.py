@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Minimal stand-in for an S3-compatible object store.
+
+Accepts HTTP/1.1 PUT requests with keep-alive and stores every object as a
+file below the given directory, e.g. PUT /bucket/car/0001.png is written to
+<directory>/bucket/car/0001.png. Meant for trying out CVATTools' http://
+output locally:
+
+    python3 tools/object_store_standin.py --port 9000 store/
+    CVATTools annotations.xml http://localhost:9000/bucket
+
+--fail-every N answers every Nth request with 503 to exercise the retries.
+"""
+
+import argparse
+import http.server
+import os
+import threading
+import urllib.parse
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("directory")
+    parser.add_argument("--port", type=int, default=9000)
+    parser.add_argument("--fail-every", type=int, default=0)
+    args = parser.parse_args()
+
+    lock = threading.Lock()
+    counter = {"requests": 0, "connections": 0}
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def setup(self):
+            super().setup()
+            with lock:
+                counter["connections"] += 1
+
+        def do_PUT(self):
+            body = self.rfile.read(int(self.headers["Content-Length"]))
+            with lock:
+                counter["requests"] += 1
+                fail = args.fail_every and counter["requests"] % args.fail_every == 0
+            if fail:
+                self.send_response(503)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            path = urllib.parse.unquote(urllib.parse.urlparse(self.path).path)
+            target = os.path.join(args.directory, path.lstrip("/"))
+            if not os.path.abspath(target).startswith(os.path.abspath(args.directory)):
+                self.send_response(400)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            os.makedirs(os.path.dirname(target), exist_ok=True)
+            with open(target, "wb") as f:
+                f.write(body)
+            self.send_response(200)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+
+        def log_message(self, format, *args):
+            pass
+
+    server = http.server.ThreadingHTTPServer(("", args.port), Handler)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(f"{counter['requests']} requests on {counter['connections']} connections")
+
+
+if __name__ == "__main__":
+    main()